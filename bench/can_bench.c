@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "../src/can_agent.h"
+
+/*
+ * Microbenchmarks for the per-frame work the agent does on its hot
+ * paths, each timed in isolation over a recorded-looking trace of
+ * frames.  Every kernel runs the whole trace a number of times and the
+ * fastest run is reported, in nanoseconds and CPU cycles per frame.
+ *
+ * Cycles come from the kernel's hardware cycle counter when
+ * perf_event_open() allows it, which works the same on x86 and ARM.
+ * Without it x86 falls back to the TSC, which counts at a fixed
+ * reference rate rather than the core clock; other CPUs only report
+ * time.
+ */
+
+#define CAN_BENCH_TRACE_LEN 4096
+#define CAN_BENCH_RUNS 7
+
+typedef struct {
+    const char *name;
+    void (*init)(void);           /* may be 0 */
+    unsigned long (*run)(void);   /* returns a checksum so nothing is optimised away */
+} canBenchKernel_t;
+
+static struct can_frame trace[CAN_BENCH_TRACE_LEN];
+static char traceMsgs[CAN_BENCH_TRACE_LEN][CAN_MAX_DLEN + 1];
+static size_t traceMsgLens[CAN_BENCH_TRACE_LEN];
+static char traceLines[CAN_BENCH_TRACE_LEN][CAN_TEXT_MAX_LINE];
+static size_t traceLineLens[CAN_BENCH_TRACE_LEN];
+static canConfig_t *benchConfig;
+static canGateway_t *benchGateway;
+static volatile unsigned long sink;
+
+static int perfFd = -1;
+static int haveCycles;
+static const char *cycleSource = "none";
+
+/* small deterministic generator so every run sees the same trace */
+static uint32_t benchSeed = 12345;
+static uint32_t canBenchRandom(void)
+{
+    benchSeed = benchSeed * 1103515245 + 12345;
+    return benchSeed >> 8;
+}
+
+/*
+ * The trace mixes the IDs a typical vehicle bus carries: a few standard
+ * IDs sent every 10 ms that make up most of the traffic, a longer tail
+ * of slower ones, and J1939 style extended IDs from a handful of source
+ * addresses.  Frequencies fall off roughly as 1/rank.
+ */
+static void canBenchMakeTrace(void)
+{
+    static const canid_t sffIds[] = {
+        0x0C4, 0x0C8, 0x100, 0x101, 0x120, 0x1A0, 0x1F0, 0x200, 0x210,
+        0x280, 0x2C0, 0x300, 0x3E0, 0x400, 0x420, 0x500, 0x580, 0x5FF,
+        0x600, 0x6F0, 0x700, 0x7DF, 0x7E8
+    };
+    static const uint32_t pgns[] = {
+        0xF004, 0xF003, 0xFEF1, 0xFEEE, 0xFEF2, 0xFEF5, 0xFECA, 0xFEE5,
+        0xEF00, 0xEA00
+    };
+    static const uint8_t sources[] = { 0x00, 0x03, 0x0B, 0x17, 0x21, 0x31 };
+    const int sffCount = sizeof(sffIds) / sizeof(sffIds[0]);
+    const int idCount = sffCount + 24;
+    uint32_t weights[64];
+    uint32_t total = 0;
+    int i;
+
+    for (i = 0; i < idCount; i++) {
+        weights[i] = 100000 / (i + 1);
+        total += weights[i];
+    }
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        struct can_frame *frame = &trace[i];
+        uint32_t pick = canBenchRandom() % total;
+        int rank = 0;
+        int j;
+
+        while (pick >= weights[rank]) {
+            pick -= weights[rank++];
+        }
+
+        memset(frame, 0, sizeof(*frame));
+        if (rank < sffCount) {
+            frame->can_id = sffIds[rank];
+        } else {
+            /* spread the extended IDs over PGNs and sources */
+            const int e = rank - sffCount;
+            const uint32_t pgn = pgns[e % (sizeof(pgns) / sizeof(pgns[0]))];
+            const uint8_t sa = sources[e % (sizeof(sources) / sizeof(sources[0]))];
+            frame->can_id = CAN_EFF_FLAG | (6U << 26) | (pgn << 8) | sa;
+        }
+
+        /* nearly everything is 8 bytes, diagnostics are shorter */
+        frame->can_dlc = ((canBenchRandom() % 10) == 0) ?
+                         1 + canBenchRandom() % 7 : CAN_MAX_DLEN;
+        for (j = 0; j < frame->can_dlc; j++) {
+            /* printable so the legacy text relay carries every byte */
+            frame->data[j] = 0x20 + canBenchRandom() % 0x5F;
+        }
+
+        memcpy(traceMsgs[i], frame->data, frame->can_dlc);
+        traceMsgs[i][frame->can_dlc] = '\0';
+        traceMsgLens[i] = frame->can_dlc;
+
+        /* the same frame as a candump line, without its '\n' */
+        traceLineLens[i] = canTextFormat((const struct canfd_frame *)frame,
+                                         CAN_MTU, traceLines[i]) - 1;
+    }
+}
+
+static void canBenchLogQuiet(void)
+{
+    LogSetVerbose(0);
+}
+
+static void canBenchLogVerbose(void)
+{
+    LogSetVerbose(1);
+}
+
+/* frame to client message, what the RX path does before the write */
+static unsigned long canBenchFormat(void)
+{
+    char msgBuff[CAN_MAX_DLEN + 1];
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        canServerSocketFormat(&trace[i], msgBuff);
+        sum += strlen(msgBuff);
+    }
+    return sum;
+}
+
+/* client message to frames, what the TX path does before queueing */
+static unsigned long canBenchParse(void)
+{
+    static struct can_frame frames[CAN_TIO_MAX_FRAMES];
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        sum += canServerSocketParse(traceMsgs[i], traceMsgLens[i], frames,
+                                    CAN_TIO_MAX_FRAMES);
+        sum += frames[0].can_dlc;
+    }
+    return sum;
+}
+
+/* a receive batch to candump lines in one buffer */
+static unsigned long canBenchTextFormat(void)
+{
+    static char textBuff[CAN_RX_BATCH_SIZE * CAN_TEXT_MAX_LINE + 1];
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i += CAN_RX_BATCH_SIZE) {
+        sum += canTextFormatBatch(&trace[i], CAN_RX_BATCH_SIZE, textBuff);
+    }
+    return sum;
+}
+
+/* candump lines from a client to frames */
+static unsigned long canBenchTextParse(void)
+{
+    struct canfd_frame frame;
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        sum += canTextParse(traceLines[i], traceLineLens[i], &frame);
+        sum += frame.data[0];
+    }
+    return sum;
+}
+
+static void canBenchFilterInit(void)
+{
+    static const char config[] =
+        "filter 000/700\n"
+        "filter 200/600\n"
+        "filter 7E8\n"
+        "filter 18FEF100/00FFFF00\n"
+        "filter 0CF00400/00FFFF00\n"
+        "filter 18FECA00/00FFFF00\n"
+        "ratelimit 100/7F0 1000000\n"
+        "ratelimit 18FEEE00/00FFFF00 1000000\n";
+    char path[] = "/tmp/can-bench-XXXXXX";
+    const int fd = mkstemp(path);
+
+    if ((fd < 0) || (write(fd, config, sizeof(config) - 1) < 0)) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+
+    benchConfig = canConfigLoad(path, 0);
+    unlink(path);
+    if (benchConfig == 0) {
+        fprintf(stderr, "cannot load the benchmark filters\n");
+        exit(1);
+    }
+}
+
+/* client filters and rate limits */
+static unsigned long canBenchFilter(void)
+{
+    const uint64_t nowUs = canNowUs();
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        sum += canConfigPassClient(benchConfig, &trace[i], nowUs);
+    }
+    return sum;
+}
+
+static void canBenchRouteInit(void)
+{
+    static const char *routes[] = {
+        "0 100/7F0 1",
+        "0 200 1 id=201",
+        "0 7DF 1",
+        "0 300/700 2 map=7,6,5,4,3,2,1,0",
+        "0 18FEF100/00FFFF00 1",
+        "0 0CF00400 2",
+        "0 18FECA00/00FFFF00 1 id=18FECAFE",
+        "1 7E8 0"
+    };
+    const int count = sizeof(routes) / sizeof(routes[0]);
+    char line[64];
+    int i;
+
+    benchGateway = canGatewayCreate();
+    for (i = 0; i < count; i++) {
+        strcpy(line, routes[i]);
+        if ((benchGateway == 0) || (canGatewayAddRoute(benchGateway, line) <= 0)) {
+            fprintf(stderr, "bad benchmark route %s\n", routes[i]);
+            exit(1);
+        }
+    }
+    if (canGatewayCompile(benchGateway) < 0) {
+        fprintf(stderr, "cannot compile the benchmark routes\n");
+        exit(1);
+    }
+}
+
+/* gateway route lookup and rewrite for frames read on bus 0 */
+static unsigned long canBenchRoute(void)
+{
+    canGwOut_t out[CAN_MAX_BUSES * 2];
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        const int count = canGatewayRoute(benchGateway, 0, &trace[i], out,
+                                          CAN_MAX_BUSES * 2);
+        sum += count;
+        if (count > 0) {
+            sum += out[0].frame.can_id;
+        }
+    }
+    return sum;
+}
+
+/* one debug message per frame, as the RX and TX paths log them */
+static unsigned long canBenchLog(void)
+{
+    int i;
+
+    for (i = 0; i < CAN_BENCH_TRACE_LEN; i++) {
+        LogMsg(LOG_INFO, "%s: buff = %s\n", __FUNCTION__, traceMsgs[i]);
+    }
+    return CAN_BENCH_TRACE_LEN;
+}
+
+static const canBenchKernel_t kernels[] = {
+    { "format",      0,                  canBenchFormat },
+    { "parse",       0,                  canBenchParse },
+    { "text-format", 0,                  canBenchTextFormat },
+    { "text-parse",  0,                  canBenchTextParse },
+    { "filter",      canBenchFilterInit, canBenchFilter },
+    { "route",       canBenchRouteInit,  canBenchRoute },
+    { "log-off",     0,                  canBenchLog },
+    { "log-on",      canBenchLogVerbose, canBenchLog },
+};
+
+static void canBenchCyclesOpen(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perfFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perfFd >= 0) {
+        ioctl(perfFd, PERF_EVENT_IOC_ENABLE, 0);
+        haveCycles = 1;
+        cycleSource = "cpu cycles";
+        return;
+    }
+#if defined(__i386__) || defined(__x86_64__)
+    haveCycles = 1;
+    cycleSource = "tsc";
+#endif
+}
+
+/* returns 0 when there is no cycle counter */
+static uint64_t canBenchCycles(void)
+{
+    if (perfFd >= 0) {
+        uint64_t count;
+        if (read(perfFd, &count, sizeof(count)) == sizeof(count)) {
+            return count;
+        }
+        return 0;
+    }
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t canBenchNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void canBenchDumpHelp(const char *progName)
+{
+    fprintf(stderr, "usage: %s [options] [kernel...]\n"
+            "  where options are:\n"
+            "    -r<rounds>     | --rounds=<rounds>   trace passes per run (default 100)\n"
+            "    -h             | -? | --help         print usage information\n"
+            "  kernels: format parse text-format text-parse filter route\n"
+            "           log-off log-on (default all)\n",
+            progName);
+}
+
+int main(int argc, char *argv[])
+{
+    const int kernelCount = sizeof(kernels) / sizeof(kernels[0]);
+    int rounds = 100;
+    int k;
+
+    while (1) {
+        static struct option longOptions[] = {
+            { "rounds",      required_argument, 0, 'r' },
+            { "help",        no_argument,       0, 'h' },
+            { 0,             0, 0,  0  }
+        };
+        int c = getopt_long(argc, argv, "r:h?", longOptions, 0);
+
+        if (c == -1) {
+            break;  // no more options to process
+        }
+
+        switch (c) {
+        case 'r':
+            rounds = atoi(optarg);
+            if (rounds > 0) {
+                break;
+            }
+            /* fall through */
+        case '?':
+        case 'h':
+        default:
+            canBenchDumpHelp(argv[0]);
+            exit(1);
+        }
+    }
+
+    /* the kernels run with logging as the agent has it without -v */
+    LogOpen("can-agent-bench", 0, "/dev/null", 0);
+    canBenchMakeTrace();
+    canBenchCyclesOpen();
+
+    /* the configuration and routing tables come from the agent's pools */
+    if ((canArenaInit(CAN_MEMORY_BUDGET) < 0) || (canConfigPoolInit() < 0) ||
+        (canLocalPoolInit() < 0) || (canGatewayPoolInit() < 0)) {
+        fprintf(stderr, "cannot set up the memory pools\n");
+        exit(1);
+    }
+
+    printf("%d frames x %d rounds, best of %d runs, cycles from %s\n",
+        CAN_BENCH_TRACE_LEN, rounds, CAN_BENCH_RUNS, cycleSource);
+    printf("%-12s %12s %14s\n", "kernel", "ns/frame", "cycles/frame");
+
+    for (k = 0; k < kernelCount; k++) {
+        const canBenchKernel_t *kernel = &kernels[k];
+        const double frames = (double)CAN_BENCH_TRACE_LEN * rounds;
+        uint64_t bestNs = 0;
+        uint64_t bestCycles = 0;
+        int run;
+        int r;
+
+        if (optind < argc) {
+            int i;
+            for (i = optind; i < argc; i++) {
+                if (strcmp(argv[i], kernel->name) == 0) {
+                    break;
+                }
+            }
+            if (i == argc) {
+                continue;
+            }
+        }
+
+        if (kernel->init != 0) {
+            kernel->init();
+        }
+        sink += kernel->run();  /* warm up caches and branch predictors */
+
+        for (run = 0; run < CAN_BENCH_RUNS; run++) {
+            const uint64_t startNs = canBenchNowNs();
+            const uint64_t startCycles = canBenchCycles();
+            uint64_t ns;
+            uint64_t cycles;
+
+            for (r = 0; r < rounds; r++) {
+                sink += kernel->run();
+            }
+
+            cycles = canBenchCycles() - startCycles;
+            ns = canBenchNowNs() - startNs;
+            if ((run == 0) || (ns < bestNs)) {
+                bestNs = ns;
+                bestCycles = cycles;
+            }
+        }
+
+        if (kernel->init == canBenchLogVerbose) {
+            canBenchLogQuiet();
+        }
+        if (haveCycles) {
+            printf("%-12s %12.2f %14.2f\n", kernel->name, bestNs / frames,
+                bestCycles / frames);
+        } else {
+            printf("%-12s %12.2f %14s\n", kernel->name, bestNs / frames, "-");
+        }
+    }
+
+    canConfigFree(benchConfig);
+    canGatewayFree(benchGateway);
+    LogClose();
+    return 0;
+}
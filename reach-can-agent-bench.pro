@@ -0,0 +1,18 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+CONFIG += release
+TARGET=can-agent-bench
+# the kernels under test are built exactly as in the agent
+SOURCES += bench/can_bench.c \
+        src/can_server_socket.c \
+        src/can_text.c \
+        src/can_config.c \
+        src/can_pool.c \
+        src/can_dispatch.c \
+        src/can_gateway.c \
+        src/can_local.c \
+        src/logmsg.c
+
+HEADERS += src/can_agent.h
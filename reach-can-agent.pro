@@ -10,7 +10,20 @@ SOURCES += src/can_agent.c \
         src/can_local.c \
         src/can_tio_socket.c \
         src/can_server_socket.c \
+        src/can_text.c \
+        src/can_tx_queue.c \
+        src/can_bus_monitor.c \
+        src/can_dispatch.c \
+        src/can_gateway.c \
+        src/can_config.c \
+        src/can_pool.c \
+        src/can_control.c \
+        src/can_transaction.c \
+        src/can_j1939.c \
+        src/can_handover.c \
         src/logmsg.c
 
 HEADERS += src/can_agent.h
 
+LIBS += -lpthread
+
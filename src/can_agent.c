@@ -6,19 +6,58 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <linux/can/netlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "can_agent.h"
 
 /* module-wide "global" variables */
 static int keepGoing;
+static volatile sig_atomic_t dumpStats;
+static int candumpText;     /* clients talk in candump lines, not raw payload */
+static uint64_t j1939Name;  /* the agent's J1939 NAME */
+static int j1939Addr = -1;  /* preferred J1939 address, -1 without J1939 */
+static int takeover;        /* start from the sockets of a running agent */
+static int handedOver;      /* a new agent has the sockets, leave them be */
 static const char *progName;
 
+/* the buffers one pass of the main loop works in */
+typedef struct {
+    struct can_frame rxFrames[CAN_RX_BATCH_SIZE];
+    canRxInfo_t rxInfos[CAN_RX_BATCH_SIZE];
+    struct can_frame clientFrames[CAN_RX_BATCH_SIZE];
+    char text[3 * CAN_TEXT_MAX_NOTICE + CAN_RX_BATCH_SIZE * CAN_TEXT_MAX_LINE + 1];
+    canTxnEvent_t txnEvents[2 * CAN_TXN_MAX];
+    canTioMsg_t msgs[CAN_TIO_MAX_MSGS];
+    struct can_frame txFrames[CAN_TIO_MAX_FRAMES];
+    canJ1939Msg_t j1939Msg;
+    char j1939Line[CAN_J1939_MAX_LINE];
+} canBatch_t;
+
+/* carved from the memory budget at startup, see canAgentPoolInit() */
+static canPool_t interfacePool;
+static canPool_t txQueuePool;
+static canTioClient_t *clientTable;
+static canTxnTable_t *txnTable;
+static canJ1939_t *j1939Node;
+static canBatch_t *batch;
+
+/* the handover message, received at startup or sent when handing over */
+static canHandover_t handoverMsg;
+
 static void canDumpHelp();
-static void canAgent(unsigned short tcpPort, int baudRate, const char *unixSocketPath);
+static void canAgentPoolInit(void);
+static void canAgent(unsigned short tcpPort, int baudRate, const char *unixSocketPath,
+                     int txQuota, const char *configPath, const char *gatewayPath);
 static inline int max(int a, int b) { return (a > b) ? a : b; }
-static ethIf_t * network_open(uint8_t instance, int baudRate);
+static inline uint64_t max64(uint64_t a, uint64_t b) { return (a > b) ? a : b; }
+static ethIf_t * network_open(uint8_t instance, int baudRate, int loadModule);
 static int network_close(ethIf_t *ep);
+static int network_restart(ethIf_t *ep);
 static int execute_cmd_ex(const char *cmd, char *result, int result_size);
 
 
@@ -27,6 +66,10 @@ int main(int argc, char *argv[])
     int daemonFlag = 0;
     unsigned short canPort = 0;
     int baudRate = 0;
+    int txQuota = 0;
+    size_t memoryBudget = CAN_MEMORY_BUDGET;
+    const char *configPath = 0;
+    const char *gatewayPath = 0;
     const char *logFilePath = 0;
     /*
      * syslog isn't installed on the target so it's disabled in this program
@@ -47,11 +90,18 @@ int main(int argc, char *argv[])
             { "log",         required_argument, 0, 'o' },
             { "can_port",    required_argument, 0, 'c' },
             { "baudrate",    required_argument, 0, 'b' },
+            { "tx_quota",    required_argument, 0, 'q' },
+            { "gateway",     required_argument, 0, 'g' },
+            { "config",      required_argument, 0, 'f' },
+            { "text",        required_argument, 0, 't' },
+            { "j1939",       required_argument, 0, 'j' },
+            { "takeover",    no_argument,       0, 'u' },
+            { "memory",      required_argument, 0, 'm' },
             { "verbose",     no_argument,       0, 'v' },
             { "help",        no_argument,       0, 'h' },
             { 0,             0, 0,  0  }
         };
-        int c = getopt_long(argc, argv, "d:o:c:b:vh?", longOptions, 0);
+        int c = getopt_long(argc, argv, "d:o:c:b:q:g:f:t:j:um:vh?", longOptions, 0);
 
         if (c == -1) {
             break;  // no more options to process
@@ -77,6 +127,46 @@ int main(int argc, char *argv[])
         case 'b':
             baudRate = (optarg == 0) ? CAN_BAUD_RATE : atoi(optarg);
             break;
+        case 'q':
+            txQuota = (optarg == 0) ? 0 : atoi(optarg);
+            break;
+        case 'g':
+            gatewayPath = optarg;
+            break;
+        case 'f':
+            configPath = optarg;
+            break;
+        case 't':
+            if (strcmp(optarg, "candump") == 0) {
+                candumpText = 1;
+            } else if (strcmp(optarg, "legacy") == 0) {
+                candumpText = 0;
+            } else {
+                canDumpHelp();
+                exit(1);
+            }
+            break;
+        case 'j':
+            {
+                char *end;
+
+                j1939Name = strtoull(optarg, &end, 16);
+                j1939Addr = 0x80;
+                if (*end == ',') {
+                    j1939Addr = strtoul(end + 1, &end, 16);
+                }
+                if ((*end != '\0') || (j1939Addr > 0xFD)) {
+                    canDumpHelp();
+                    exit(1);
+                }
+            }
+            break;
+        case 'u':
+            takeover = 1;
+            break;
+        case 'm':
+            memoryBudget = (size_t)atoi(optarg) * 1024;
+            break;
 
         case 'v':
             verboseFlag = 1;
@@ -93,11 +183,30 @@ int main(int argc, char *argv[])
     /* set up logging to syslog or file; will be STDERR not told otherwise */
     LogOpen(progName, logToSyslog, logFilePath, verboseFlag);
 
+    /* J1939 messages only have a line format in candump mode */
+    if ((j1939Addr >= 0) && !candumpText) {
+        LogMsg(LOG_ERR, "--j1939 needs --text=candump\n");
+        exit(1);
+    }
+
     if (daemonFlag) {
         daemon(0, 1);
     }
 
-    canAgent(canPort, baudRate, CAN_AGENT_UNIX_SOCKET);
+    /* every table is carved before the first frame, or the agent stops */
+    if (canArenaInit(memoryBudget) < 0) {
+        exit(1);
+    }
+    canAgentPoolInit();
+    canConfigPoolInit();
+    canLocalPoolInit();
+    canGatewayPoolInit();
+    if (canArenaCheck() < 0) {
+        exit(1);
+    }
+
+    canAgent(canPort, baudRate, CAN_AGENT_UNIX_SOCKET, txQuota, configPath,
+             gatewayPath);
 
     return 0;
 }
@@ -112,43 +221,657 @@ static void canDumpHelp()
             "    -o<path>       | --logfile=<path>    log to file instead of stderr\n"
             "    -c[<port>]     | --can_port[=<port>] CAN bus port 0, 1 ,2 \n"
             "    -b<baudrate>   | --baudrate          baudrate of CAN bus \n"
+            "    -q<frames>     | --tx_quota=<frames> most frames queued per client\n"
+            "    -g<path>       | --gateway=<path>    forward frames between buses\n"
+            "    -f<path>       | --config=<path>     filters, rate limits and routes\n"
+            "    -t<format>     | --text=<format>     client text: legacy or candump\n"
+            "    -j<name,sa>    | --j1939=<name,sa>   J1939 NAME and address, hex\n"
+            "    -u             | --takeover          replace the running agent\n"
+            "    -m<KiB>        | --memory=<KiB>      memory budget for all tables\n"
             "    -v             | --verbose           print progress messages\n"
             "    -h             | -? | --help         print usage information\n",
             progName, CAN_DEFAULT_SERVER_AGENT_PORT);
 }
 
+/**
+ * Carves the main loop's tables from the memory budget, each sized from
+ * its limit.  What does not fit is reported by canArenaCheck().
+ */
+static void canAgentPoolInit(void)
+{
+    canPoolInit(&interfacePool, "interface", sizeof(ethIf_t), CAN_MAX_BUSES);
+    canPoolInit(&txQueuePool, "tx queue", sizeof(canTxQueue_t), CAN_MAX_BUSES);
+    clientTable = canArenaAlloc(CAN_MAX_CLIENTS * sizeof(*clientTable));
+    txnTable = canArenaAlloc(sizeof(*txnTable));
+    j1939Node = canArenaAlloc(sizeof(*j1939Node));
+    batch = canArenaAlloc(sizeof(*batch));
+}
+
 static void canInterruptHandler(int sig)
 {
     keepGoing = 0;
 }
 
+static void canStatsHandler(int sig)
+{
+    (void)sig;
+    dumpStats = 1;
+}
+
+static void canHangupHandler(int sig)
+{
+    (void)sig;
+    canControlHangup();
+}
+
+/* writes transaction replies to the clients they belong to */
+static void canTxnDeliver(canTioClient_t *tioClients,
+                          const canTxnEvent_t *events, int count)
+{
+    char line[CAN_TEXT_MAX_LINE + 16];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tioClients[events[i].client].fd >= 0) {
+            canTxnFormatEvent(&events[i], line);
+            canTioSocketWrite(&tioClients[events[i].client], line);
+        }
+    }
+}
+
+/**
+ * Handles a '?' line from a candump mode client: "?stream off|on" to
+ * stop or resume its stream of received frames, "?j1939 ..." to change
+ * its J1939 subscriptions, anything else starts a transaction.
+ *
+ * @return int 0 on success, -1 if a request was refused
+ */
+static int canClientCommand(canTxQueue_t *txQueue, canTxnTable_t *txns,
+                            canJ1939_t *j1939, canTioClient_t *tioClients,
+                            int client, char *line)
+{
+    canTxnRequest_t req;
+    canTxnEvent_t event;
+
+    if (strncmp(line, "?j1939 ", 7) == 0) {
+        if ((j1939->dataFd < 0) || (canJ1939Command(j1939, client, line + 7) < 0)) {
+            LogMsg(LOG_ERR, "client %d: J1939 subscription refused\n", client);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(line, "?stream off") == 0) {
+        tioClients[client].relay = 0;
+        return 0;
+    }
+    if (strcmp(line, "?stream on") == 0) {
+        tioClients[client].relay = 1;
+        return 0;
+    }
+
+    if ((canTxnParse(line, &req) == 0) && (txns->active < CAN_TXN_MAX) &&
+        (canTxQueuePush(txQueue, &req.frame, client, 0) == 0)) {
+        canTxnStart(txns, client, &req, canNowUs());
+        return 0;
+    }
+
+    LogMsg(LOG_ERR, "client %d: transaction %u refused\n", client, req.tag);
+    event.client = client;
+    event.tag = req.tag;
+    event.kind = CAN_TXN_ERROR;
+    canTxnDeliver(tioClients, &event, 1);
+    return -1;
+}
+
+/* returns the number of frames that could not be queued */
+static int canQueueClientMsgs(canTxQueue_t *txQueue, canTxnTable_t *txns,
+                              canJ1939_t *j1939, canTioClient_t *tioClients,
+                              int client, const canTioMsg_t *msgs, int msgCount)
+{
+    struct can_frame *const frames = batch->txFrames;
+    int dropped = 0;
+    int i;
+
+    for (i = 0; i < msgCount; i++) {
+        int frameCount;
+        int j;
+
+        if (candumpText && (msgs[i].data[0] == '?')) {
+            if (canClientCommand(txQueue, txns, j1939, tioClients, client,
+                                 msgs[i].data) < 0) {
+                dropped++;
+            }
+            continue;
+        } else if (candumpText && (msgs[i].data[0] == 'J')) {
+            /* J1939 goes around the queue, the kernel runs its transport */
+            if ((j1939->dataFd < 0) ||
+                (canJ1939Send(j1939, msgs[i].data, msgs[i].len) < 0)) {
+                LogMsg(LOG_ERR, "client %d: J1939 message \"%s\" not sent\n",
+                    client, msgs[i].data);
+                dropped++;
+            }
+            continue;
+        } else if (candumpText) {
+            /* one frame per line; the CAN sockets only carry classic frames */
+            struct canfd_frame line;
+            const int mtu = canTextParse(msgs[i].data, msgs[i].len, &line);
+
+            if (mtu != CAN_MTU) {
+                LogMsg(LOG_ERR, "client %d: %s frame \"%s\" not sent\n", client,
+                    (mtu == CANFD_MTU) ? "CAN FD" : "bad", msgs[i].data);
+                dropped++;
+                continue;
+            }
+            memcpy(&frames[0], &line, sizeof(frames[0]));
+            frameCount = 1;
+        } else {
+            frameCount = canServerSocketParse(msgs[i].data, msgs[i].len,
+                                              frames, CAN_TIO_MAX_FRAMES);
+        }
+
+        for (j = 0; j < frameCount; j++) {
+            if (canTxQueuePush(txQueue, &frames[j], client, 0) < 0) {
+                dropped++;
+            }
+        }
+    }
+
+    return dropped;
+}
+
+/**
+ * Dispatches one received frame: error frames to the bus monitor,
+ * loopback copies to the transmit queue, everything else through the
+ * gateway routes unless it is being shed.
+ *
+ * @return int 1 for a frame from another node on the bus, 0 otherwise
+ */
+static int canBusDispatch(canBus_t *buses, int b, canConfig_t *cfg,
+                          const struct can_frame *frame,
+                          const canRxInfo_t *info, int shed, uint64_t nowUs)
+{
+    canBus_t *bus = &buses[b];
+    int i;
+
+    if (frame->can_id & CAN_ERR_FLAG) {
+        if (canBusMonitorError(&bus->monitor, frame) && (bus->restartUs == 0)) {
+            /* don't restart more often than the holdoff allows */
+            bus->restartUs = max64(nowUs, bus->lastRestartUs + CAN_RESTART_HOLDOFF_US);
+        }
+        return 0;
+    }
+
+    if (info->ownMsg) {
+        canBusMonitorFrame(&bus->monitor, frame, 1, nowUs);
+        canTxQueueConfirm(bus->txQueue, frame);
+        return 0;
+    }
+
+    canBusMonitorFrame(&bus->monitor, frame, 0, nowUs);
+
+    if ((cfg->gateway != 0) && !shed) {
+        canGwOut_t out[CAN_MAX_BUSES * 2];
+        const int count = canGatewayRoute(cfg->gateway, b, frame, out,
+                                          sizeof(out) / sizeof(out[0]));
+
+        for (i = 0; i < count; i++) {
+            canBus_t *dst = &buses[out[i].bus];
+            if ((dst->fd < 0) ||
+                (canTxQueuePush(dst->txQueue, &out[i].frame, -1, info->rxUs) < 0)) {
+                bus->gwDropped++;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Runs the rules for a frame from another node and carries out the
+ * actions of those that fire.
+ */
+static void canBusRules(canBus_t *buses, int b, canConfig_t *cfg,
+                        const struct can_frame *frame, const canRxInfo_t *info,
+                        canTioClient_t *tioClients, uint64_t nowUs)
+{
+    const canRule_t *fired[CAN_RULES_MAX];
+    char line[CAN_RULE_MAX_LINE];
+    int count;
+    int r;
+    int i;
+
+    count = canLocalMatch(cfg->rules, b, frame, nowUs, fired, CAN_RULES_MAX);
+    for (r = 0; r < count; r++) {
+        const canRule_t *rule = fired[r];
+
+        if (rule->sendBus >= 0) {
+            canBus_t *dst = &buses[rule->sendBus];
+            if ((dst->fd < 0) ||
+                (canTxQueuePush(dst->txQueue, &rule->send, -1, info->rxUs) < 0)) {
+                LogMsg(LOG_ERR, "rule %s: frame for can%d dropped\n",
+                    rule->name, rule->sendBus);
+            }
+        }
+        /* the legacy messages cannot carry a notice */
+        if (rule->notify && candumpText) {
+            canLocalFormat(rule, frame, line);
+            for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+                if (tioClients[i].fd >= 0) {
+                    canTioSocketWrite(&tioClients[i], line);
+                }
+            }
+        }
+        canLocalCapture(rule, nowUs);
+    }
+}
+
+/**
+ * Starts the candump text for the clients with the notices they are
+ * due: a change of the shed level, then the frames they missed.  Missed
+ * frames wait while the stream is held back and are told about once it
+ * flows again.
+ *
+ * @return size_t the number of characters written
+ */
+static size_t canBusNotices(canBusMonitor_t *m, int levelChanged, char *out)
+{
+    char *p = out;
+
+    if (levelChanged) {
+        p += sprintf(p, "!degraded %s\n", canBusMonitorShedName(m->shedLevel));
+    }
+    if (m->shedLevel < CAN_SHED_STREAM) {
+        if (m->gapDrops > 0) {
+            p += sprintf(p, "!gap %u kernel\n", m->gapDrops);
+            m->gapDrops = 0;
+        }
+        if (m->gapShed > 0) {
+            p += sprintf(p, "!gap %u shed\n", m->gapShed);
+            m->gapShed = 0;
+        }
+    }
+    return p - out;
+}
+
+/**
+ * Reads the frames waiting on a bus and dispatches them.  On the
+ * clients' bus the frames first answer the transactions waiting for
+ * them, then those that pass the filters and rate limits are formatted
+ * into one buffer and sent to every client with one write.
+ *
+ * When the agent cannot keep up with the bus the monitor raises the shed
+ * level: first the frames of the configured shed IDs are neither routed
+ * nor relayed, then the clients' stream is held back altogether.
+ * Rules, transactions and J1939 subscriptions are served throughout.
+ * Candump clients are told of level changes and of the frames they
+ * missed.
+ *
+ * @return int -1 if the socket failed and was closed, otherwise 0
+ */
+static int canBusReceive(canBus_t *buses, int b, int clientBus,
+                         canConfig_t *cfg, canTxnTable_t *txns,
+                         canTioClient_t *tioClients)
+{
+    struct can_frame *const frames = batch->rxFrames;
+    canRxInfo_t *const infos = batch->rxInfos;
+    struct can_frame *const clientFrames = batch->clientFrames;
+    char *const textBuff = batch->text;
+    canTxnEvent_t *const txnEvents = batch->txnEvents;
+    canBusMonitor_t *m = &buses[b].monitor;
+    int clientCount = 0;
+    size_t textLen = 0;
+    int i;
+
+    const int count = canServerSocketReadBatch(buses[b].fd, frames, infos,
+                                               CAN_RX_BATCH_SIZE);
+    if (count <= 0) {
+        return count;
+    }
+
+    const uint64_t nowUs = canNowUs();
+    const int level = m->shedLevel;
+
+    const uint32_t dropped = canBusMonitorRxRead(m, count,
+                                                 count == CAN_RX_BATCH_SIZE,
+                                                 infos[count - 1].dropCount,
+                                                 nowUs);
+    if (b == clientBus) {
+        m->gapDrops += dropped;
+    }
+
+    for (i = 0; i < count; i++) {
+        const int shed = (m->shedLevel >= CAN_SHED_IDS) &&
+                         canConfigShed(cfg, &frames[i]);
+
+        canLocalCaptureFrame(b, &frames[i], infos[i].rxUs);
+        if (!canBusDispatch(buses, b, cfg, &frames[i], &infos[i], shed, nowUs)) {
+            continue;
+        }
+        /* interlocks run whatever is being shed */
+        if (cfg->rules != 0) {
+            canBusRules(buses, b, cfg, &frames[i], &infos[i], tioClients, nowUs);
+        }
+        if (shed) {
+            m->rxShed++;
+        }
+        if (b != clientBus) {
+            continue;
+        }
+        canTxnDeliver(tioClients, txnEvents,
+                      canTxnMatch(txns, &frames[i], txnEvents));
+        if (shed) {
+            m->gapShed++;
+        } else if (m->shedLevel == CAN_SHED_STREAM) {
+            m->rxShed++;
+            m->gapShed++;
+        } else if (canConfigPassClient(cfg, &frames[i], nowUs)) {
+            clientFrames[clientCount++] = frames[i];
+        }
+    }
+
+    if (b != clientBus) {
+        return 0;
+    }
+
+    if (candumpText) {
+        textLen = canBusNotices(m, m->shedLevel != level, textBuff);
+        textLen += canTextFormatBatch(clientFrames, clientCount,
+                                      textBuff + textLen);
+    } else {
+        /* the legacy messages have no delimiters, so no room for notices */
+        m->gapDrops = 0;
+        m->gapShed = 0;
+        for (i = 0; i < clientCount; i++) {
+            canServerSocketFormat(&clientFrames[i], textBuff + textLen);
+            textLen += strlen(textBuff + textLen);
+        }
+    }
+
+    if (textLen > 0) {
+        for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+            if ((tioClients[i].fd >= 0) && tioClients[i].relay) {
+                canTioSocketWrite(&tioClients[i], textBuff);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends what a bus's transmit queue holds, unless the bus is backing
+ * off after ENOBUFS.
+ */
+static void canBusFlush(canBus_t *bus)
+{
+    if ((bus->fd < 0) || (bus->txQueue->count == 0) ||
+        ((bus->txRetryUs != 0) && (canNowUs() < bus->txRetryUs))) {
+        return;
+    }
+    if (canTxQueueFlush(bus->txQueue, bus->fd) < 0) {
+        bus->txRetryUs = canNowUs() + CAN_TX_BACKOFF_US;
+    } else {
+        bus->txRetryUs = 0;
+    }
+}
+
+/**
+ * Reads the J1939 messages waiting, a batch at most, and sends each to
+ * the clients that subscribed to it.
+ */
+static void canJ1939Receive(canJ1939_t *j1939, canTioClient_t *tioClients)
+{
+    canJ1939Msg_t *const msg = &batch->j1939Msg;
+    char *const line = batch->j1939Line;
+    int count;
+    int i;
+
+    for (count = 0; count < CAN_RX_BATCH_SIZE; count++) {
+        int formatted = 0;
+
+        if (canJ1939Read(j1939, msg) <= 0) {
+            break;
+        }
+        for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+            if ((tioClients[i].fd >= 0) && canJ1939Wanted(j1939, i, msg)) {
+                if (!formatted) {
+                    canJ1939Format(msg, line);
+                    formatted = 1;
+                }
+                canTioSocketWrite(&tioClients[i], line);
+            }
+        }
+    }
+}
+
+/**
+ * Passes the sockets and state to a new agent waiting on the handover
+ * socket.  Queued frames are flushed once first; what the controller
+ * does not take goes over in the queues.
+ *
+ * @return int 0 if the new agent took over, -1 to carry on
+ */
+static int canHandOver(int handoverFd, int canPort, int listenTIOFd,
+                       canBus_t *buses, canTioClient_t *tioClients,
+                       canTxnTable_t *txns, canJ1939_t *j1939)
+{
+    canHandover_t *const state = &handoverMsg;
+    int fds[CAN_HANDOVER_MAX_FDS];
+    int fdCount = 0;
+    int b;
+    int i;
+
+    memset(state, 0, sizeof(*state));
+    state->canPort = canPort;
+    state->listenFd = fdCount;
+    fds[fdCount++] = listenTIOFd;
+
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        canBus_t *bus = &buses[b];
+
+        state->buses[b].fd = -1;
+        if (bus->fd < 0) {
+            continue;
+        }
+        canTxQueueFlush(bus->txQueue, bus->fd);
+        state->buses[b].fd = fdCount;
+        fds[fdCount++] = bus->fd;
+        state->buses[b].ep = *bus->ep;
+        state->buses[b].txQueue = *bus->txQueue;
+        state->buses[b].monitor = bus->monitor;
+        state->buses[b].restartUs = bus->restartUs;
+        state->buses[b].lastRestartUs = bus->lastRestartUs;
+        state->buses[b].gwDropped = bus->gwDropped;
+    }
+
+    for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+        state->clients[i] = tioClients[i];
+        if (tioClients[i].fd >= 0) {
+            state->clients[i].fd = fdCount;
+            fds[fdCount++] = tioClients[i].fd;
+        }
+    }
+
+    state->txns = *txns;
+    state->j1939 = *j1939;
+    if (j1939->dataFd >= 0) {
+        state->j1939.claimFd = fdCount;
+        fds[fdCount++] = j1939->claimFd;
+        state->j1939.dataFd = fdCount;
+        fds[fdCount++] = j1939->dataFd;
+    }
+
+    return canHandoverSend(handoverFd, state, fds, fdCount);
+}
+
+/**
+ * Sets up the buses handed over by the agent that ran before.
+ */
+static void canTakeOverBuses(const canHandover_t *state, const int *fds,
+                             canBus_t *buses)
+{
+    int b;
+
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        canBus_t *bus = &buses[b];
+
+        if (state->buses[b].fd < 0) {
+            continue;
+        }
+        if ((bus->ep = canPoolGet(&interfacePool)) == NULL) {
+            LogMsg(LOG_ERR, "Error: %s: no free interface\n", __FUNCTION__);
+            exit(1);
+        }
+        if ((bus->txQueue = canPoolGet(&txQueuePool)) == NULL) {
+            LogMsg(LOG_ERR, "Error: %s: no free transmit queue\n", __FUNCTION__);
+            exit(1);
+        }
+        *bus->ep = state->buses[b].ep;
+        bus->fd = fds[state->buses[b].fd];
+        *bus->txQueue = state->buses[b].txQueue;
+        bus->monitor = state->buses[b].monitor;
+        bus->txRetryUs = 0;
+        bus->restartUs = state->buses[b].restartUs;
+        bus->lastRestartUs = state->buses[b].lastRestartUs;
+        bus->gwDropped = state->buses[b].gwDropped;
+        LogMsg(LOG_INFO, "%s taken over\n", bus->ep->if_name);
+    }
+}
+
 /**
  * This is the main loop function.  It opens and configures the
  * CAN Bus Server port and opens the TIO socket using a Unix
  * domain and enters a select loop waiting for connections.
  *
+ * Frames from the clients go through a transmit queue that hands them
+ * to the controller in arbitration priority order and holds them while
+ * the controller queue is full.  Error frames are tracked to follow the
+ * controller state and the interface is restarted when the bus goes
+ * off.  SIGUSR1 logs the queue metrics, bus load and error state.
+ *
+ * With a gateway routing table every bus it names is opened as well and
+ * received frames are forwarded according to the routes before the
+ * clients see them.
+ *
+ * Clients exchange either the legacy raw payload text or candump style
+ * lines (-t candump), which carry the ID and binary payload intact.
+ * Received frames are read and relayed to the clients in batches.
+ * Writes to a client never wait: what its socket does not take is
+ * buffered, and a client that falls further behind than its buffer
+ * holds is dropped.
+ * candump clients can also run request/response transactions, see
+ * can_transaction.c, and with -j send and subscribe to J1939 messages
+ * through the kernel's J1939 stack, see can_j1939.c.
+ *
+ * The configuration file and routing table are read again on SIGHUP or
+ * a "reload" on the control socket.  The new filters, rate limits and
+ * routes take effect on the next pass of the loop; routes may only use
+ * the buses opened at startup.
+ *
+ * Started with --takeover, the agent takes the interfaces, sockets,
+ * clients and queues over from the running one through the handover
+ * socket (see can_handover.c) instead of bringing the interfaces up, and
+ * the old agent exits leaving them as they are.
+ *
  * @param canPort the port number to open for
  *        accepting connections from the CAN Bus 0 for can0 1 for can1 ect;
  *
  * @param unixSocketPath the file system path to use for a Unix domain socket;
+ *
+ * @param txQuota the most frames one client may have queued, 0 for no limit;
+ *
+ * @param configPath the configuration file, or 0 for none;
+ *
+ * @param gatewayPath the gateway routing table file, or 0 for no gateway;
  */
-static void canAgent(unsigned short canPort, int baudRate, const char *unixSocketPath)
+static void canAgent(unsigned short canPort, int baudRate, const char *unixSocketPath,
+                     int txQuota, const char *configPath, const char *gatewayPath)
 {
     int n;
-    ethIf_t *ep = NULL;
+    int i;
+    int b;
+    uint32_t busMask = 0;
+    canConfig_t *cfg;
+    int rcvBuf = 0;         /* receive buffer size the sockets were given */
+    static canBus_t buses[CAN_MAX_BUSES];
     fd_set currFdSet;
     FD_ZERO(&currFdSet);
 
+    if (canPort >= CAN_MAX_BUSES) {
+        LogMsg(LOG_ERR, "Error: %s: CAN port %d out of range\n", __FUNCTION__, canPort);
+        exit(1);
+    }
+
+    cfg = canConfigLoad(configPath, gatewayPath);
+    if (cfg == 0) {
+        LogMsg(LOG_ERR, "could not load the configuration\n");
+        exit(1);
+    }
+    canConfigPublish(cfg);
+
     /********************************* Open CAN BUS network ********************************/
-    ep = network_open(canPort, baudRate);
-    if (ep == NULL)
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        buses[b].fd = -1;
+        buses[b].ep = NULL;
+    }
+
+    canHandover_t *const handover = &handoverMsg;
+    int handoverFds[CAN_HANDOVER_MAX_FDS];
+    int handedFds = 0;
+
+    if (takeover) {
+        handedFds = canHandoverReceive(CAN_AGENT_HANDOVER_SOCKET, canPort,
+                                       handover, handoverFds);
+        if (handedFds < 0) {
+            exit(1);
+        } else if (handedFds == 0) {
+            LogMsg(LOG_NOTICE, "no agent running to take over from\n");
+        } else {
+            canTakeOverBuses(handover, handoverFds, buses);
+        }
+    }
+
+    /* the clients' bus loads the driver, the gateway buses only come up */
+    if (buses[canPort].ep == NULL) {
+        buses[canPort].ep = network_open(canPort, baudRate, 1);
+    }
+    if (buses[canPort].ep == NULL)
     {
         LogMsg(LOG_ERR, "Error: %s: network_open() failed: %s [%d]\n", __FUNCTION__, strerror(errno), errno);
         exit(1);
     }
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        if ((buses[b].ep == NULL) && (cfg->gateway != 0) && (cfg->gateway->busMask & (1 << b))) {
+            buses[b].ep = network_open(b, baudRate, 0);
+            if (buses[b].ep == NULL)
+            {
+                LogMsg(LOG_ERR, "Error: %s: network_open() failed: %s [%d]\n", __FUNCTION__, strerror(errno), errno);
+                exit(1);
+            }
+        }
+        if (buses[b].ep != NULL) {
+            busMask |= 1 << b;
+        }
+    }
+    /* rules do not open buses, they run on the ones the agent has */
+    if ((cfg->rules != 0) && (canLocalCheckBuses(cfg->rules, busMask) < 0)) {
+        LogMsg(LOG_ERR, "the configuration has rules on buses that are not "
+            "open\n");
+        exit(1);
+    }
 
     /********************************** Set up TIO Socket ***********************************/
-    int connectedTIOFd = -1;  /* not currently connected */
+    canTioClient_t *const tioClients = clientTable;
+    canTxnTable_t *const txns = txnTable;
+    canJ1939_t *const j1939 = j1939Node;
+    int clientsHighWater = 0;
+    for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+        canTioClientInit(&tioClients[i], -1);  /* not currently connected */
+        if ((handedFds > 0) && (handover->clients[i].fd >= 0)) {
+            /* keeps any partial line the old agent had buffered */
+            tioClients[i] = handover->clients[i];
+            tioClients[i].fd = handoverFds[handover->clients[i].fd];
+        }
+    }
 
     {
         /* install a signal handler to remove the socket file */
@@ -159,12 +882,33 @@ static void canAgent(unsigned short canPort, int baudRate, const char *unixSocke
             LogMsg(LOG_ERR, "sigaction() failed, errno = %d\n", errno);
             exit(1);
         }
+
+        a.sa_handler = canStatsHandler;
+        if (sigaction(SIGUSR1, &a, 0) != 0) {
+            LogMsg(LOG_ERR, "sigaction() failed, errno = %d\n", errno);
+            exit(1);
+        }
+
+        a.sa_handler = canHangupHandler;
+        if (sigaction(SIGHUP, &a, 0) != 0) {
+            LogMsg(LOG_ERR, "sigaction() failed, errno = %d\n", errno);
+            exit(1);
+        }
+    }
+
+    /* reloads are done by the control thread, it wakes us through wakeFd */
+    const int wakeFd = canControlStart(CAN_AGENT_CONTROL_SOCKET, configPath,
+                                       gatewayPath, busMask);
+    if (wakeFd < 0) {
+        LogMsg(LOG_ERR, "could not start the control thread\n");
+        exit(1);
     }
 
-    /* open the tio socket */
-    int addressTIOFamily = 0;
-    const int listenTIOFd = canTioSocketInit(&addressTIOFamily,
-                                             unixSocketPath);
+    /* open the tio socket, or carry on with the one handed over */
+    int addressTIOFamily = AF_UNIX;
+    const int listenTIOFd = (handedFds > 0) ?
+                            handoverFds[handover->listenFd] :
+                            canTioSocketInit(&addressTIOFamily, unixSocketPath);
     if (listenTIOFd < 0) {
         /* open failed, can't continue */
         LogMsg(LOG_ERR, "could not open tio socket\n");
@@ -175,22 +919,89 @@ static void canAgent(unsigned short canPort, int baudRate, const char *unixSocke
         LogMsg(LOG_INFO, "TIO Unix Socket Open\n");
     }
 
-    FD_SET(listenTIOFd, &currFdSet);
+    FD_SET(wakeFd, &currFdSet);
+    {
+        int used = 0;
 
-    /********************************** Set up CAN Bus Socket ***********************************/
-    int connectedServerFd = -1;  /* not currently connected */
+        for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+            if (tioClients[i].fd >= 0) {
+                FD_SET(tioClients[i].fd, &currFdSet);
+                used++;
+            }
+        }
+        if (used < CAN_MAX_CLIENTS) {
+            FD_SET(listenTIOFd, &currFdSet);
+        }
+        clientsHighWater = used;
+    }
 
-    /* open the server socket */
-    connectedServerFd = canServerSocketInit(canPort);
-    if (connectedServerFd < 0) {
-        /* open failed, can't continue */
-        LogMsg(LOG_ERR, "could not open CAN Bus socket\n");
-        return;
+    /********************************** Set up CAN Bus Sockets ***********************************/
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        canBus_t *bus = &buses[b];
+
+        if (bus->ep == NULL) {
+            continue;
+        }
+
+        if (bus->fd >= 0) {
+            /* handed over with its queue and monitor */
+            bus->txQueue->clientQuota = txQuota;
+            FD_SET(bus->fd, &currFdSet);
+            continue;
+        }
+
+        /* open the server socket */
+        bus->fd = canServerSocketInit(b);
+        bus->txQueue = canPoolGet(&txQueuePool);
+        if ((bus->fd < 0) || (bus->txQueue == NULL)) {
+            /* open failed, can't continue */
+            LogMsg(LOG_ERR, "could not open CAN Bus socket\n");
+            return;
+        }
+
+        FD_SET(bus->fd, &currFdSet);
+
+        canTxQueueInit(bus->txQueue, txQuota);
+        canBusMonitorInit(&bus->monitor, baudRate);
+        bus->txRetryUs = 0;
+        bus->restartUs = 0;
+        bus->lastRestartUs = 0;
+        bus->gwDropped = 0;
     }
 
-    FD_SET(connectedServerFd, &currFdSet);
+    canTxQueue_t *clientQueue = buses[canPort].txQueue;
+    canTxnInit(txns, canNowUs());
+    if (handedFds > 0) {
+        *txns = handover->txns;
+    }
 
-    n = max(connectedServerFd, listenTIOFd) + 1;
+    /* J1939 shares the clients' bus with the raw socket */
+    j1939->claimFd = -1;
+    j1939->dataFd = -1;
+    if ((handedFds > 0) && (handover->j1939.dataFd >= 0)) {
+        *j1939 = handover->j1939;
+        j1939->claimFd = handoverFds[handover->j1939.claimFd];
+        j1939->dataFd = handoverFds[handover->j1939.dataFd];
+        if (j1939Addr < 0) {
+            canJ1939Close(j1939);
+        } else {
+            FD_SET(j1939->claimFd, &currFdSet);
+            FD_SET(j1939->dataFd, &currFdSet);
+        }
+    } else if (j1939Addr >= 0) {
+        if (canJ1939Init(j1939, canPort, j1939Name, j1939Addr, canNowUs()) < 0) {
+            LogMsg(LOG_ERR, "could not open the J1939 sockets\n");
+            exit(1);
+        }
+        FD_SET(j1939->claimFd, &currFdSet);
+        FD_SET(j1939->dataFd, &currFdSet);
+    }
+
+    /* a newer agent may take over from this one */
+    const int handoverFd = canHandoverListen(CAN_AGENT_HANDOVER_SOCKET);
+    if (handoverFd >= 0) {
+        FD_SET(handoverFd, &currFdSet);
+    }
 
     /* execution remains in this loop until a fatal error or SIGINT */
     keepGoing = 1;
@@ -198,84 +1009,287 @@ static void canAgent(unsigned short canPort, int baudRate, const char *unixSocke
     while (keepGoing) {
         /*
          * This is the select loop which waits for characters to be received on
-         * the CAN bus and on either the listen socket (meaning
+         * the CAN buses and on either the listen socket (meaning
          * an incoming connection is queued) or on a connected socket
-         * descriptor.
+         * descriptor.  While frames are queued it also waits for the
+         * CAN sockets to take more.
          */
 
+        fd_set readFdSet = currFdSet;
+        fd_set writeFdSet;
+        struct timeval timeout;
+        struct timeval *timeoutPtr = 0;
+        uint64_t wakeUs = 0;
+
+        /* no configuration pointer is held here, a replaced one may go */
+        canConfigQuiescent();
+        cfg = canConfigGet();
+
+        if (cfg->rcvBuf != rcvBuf) {
+            rcvBuf = cfg->rcvBuf;
+            for (b = 0; b < CAN_MAX_BUSES; b++) {
+                if ((buses[b].fd >= 0) && (rcvBuf > 0)) {
+                    canServerSocketSetRcvBuf(buses[b].fd, rcvBuf);
+                }
+            }
+        }
+
+        FD_ZERO(&writeFdSet);
+        n = max(max(listenTIOFd, wakeFd), max(j1939->claimFd, j1939->dataFd));
+        n = max(n, handoverFd);
+        for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+            n = max(n, tioClients[i].fd);
+            /* wait for slow clients to take what is buffered for them */
+            if ((tioClients[i].fd >= 0) && (tioClients[i].txLen > 0)) {
+                FD_SET(tioClients[i].fd, &writeFdSet);
+            }
+        }
+
+        for (b = 0; b < CAN_MAX_BUSES; b++) {
+            canBus_t *bus = &buses[b];
+
+            if (bus->fd < 0) {
+                continue;
+            }
+            n = max(n, bus->fd);
+
+            if (dumpStats) {
+                canTxQueueLogStats(bus->txQueue, bus->ep->if_name);
+                canBusMonitorLogStats(&bus->monitor, bus->ep->if_name);
+                if (cfg->gateway != 0) {
+                    LogMsg(LOG_NOTICE, "%s gateway: %llu frames dropped\n",
+                        bus->ep->if_name, (unsigned long long)bus->gwDropped);
+                }
+            }
+
+            if ((bus->restartUs != 0) && (canNowUs() >= bus->restartUs)) {
+                LogMsg(LOG_NOTICE, "restarting %s after bus-off\n", bus->ep->if_name);
+                bus->lastRestartUs = canNowUs();
+                bus->restartUs = 0;
+                if (network_restart(bus->ep) < 0) {
+                    /* still bus-off, try again after the holdoff */
+                    LogMsg(LOG_ERR, "restart of %s failed\n", bus->ep->if_name);
+                    bus->restartUs = bus->lastRestartUs + CAN_RESTART_HOLDOFF_US;
+                } else {
+                    canBusMonitorRestarted(&bus->monitor);
+                }
+            }
+
+            if ((bus->txRetryUs == 0) && (bus->txQueue->count > 0)) {
+                FD_SET(bus->fd, &writeFdSet);
+            }
+
+            /* wake up for the earliest tx retry or restart */
+            if ((bus->txRetryUs != 0) && ((wakeUs == 0) || (bus->txRetryUs < wakeUs))) {
+                wakeUs = bus->txRetryUs;
+            }
+            if ((bus->restartUs != 0) && ((wakeUs == 0) || (bus->restartUs < wakeUs))) {
+                wakeUs = bus->restartUs;
+            }
+        }
+        if (dumpStats) {
+            canConfigLogStats(cfg);
+            canTxnLogStats(txns);
+            LogMsg(LOG_NOTICE, "clients: high water %d of %d\n",
+                clientsHighWater, CAN_MAX_CLIENTS);
+            canTioSocketLogStats();
+            canMemoryLogStats();
+            if (j1939->dataFd >= 0) {
+                canJ1939LogStats(j1939);
+            }
+        }
+
+        /* wake up for the next transaction timeout */
+        const uint64_t txnUs = canTxnNextUs(txns);
+        if ((txnUs != 0) && ((wakeUs == 0) || (txnUs < wakeUs))) {
+            wakeUs = txnUs;
+        }
+        /* and for the J1939 address claim to settle */
+        const uint64_t claimUs = canJ1939NextUs(j1939);
+        if ((claimUs != 0) && ((wakeUs == 0) || (claimUs < wakeUs))) {
+            wakeUs = claimUs;
+        }
+        dumpStats = 0;
+        n++;
+
+        if (wakeUs != 0) {
+            const uint64_t nowUs = canNowUs();
+            const uint64_t waitUs = (wakeUs > nowUs) ? wakeUs - nowUs : 0;
+            timeout.tv_sec = waitUs / 1000000;
+            timeout.tv_usec = waitUs % 1000000;
+            timeoutPtr = &timeout;
+        }
+
         /* check for packet received on the server socket or tio socket */
         //wait for a message
 
-        fd_set readFdSet = currFdSet;
-        const int sel = select(n, &readFdSet, 0, 0, 0);
+        const int sel = select(n, &readFdSet, &writeFdSet, 0, timeoutPtr);
 
         if (sel == -1) {
             if (errno == EINTR) {
-                break;  /* drop out of while */
+                continue;  /* keepGoing tells whether to drop out */
             } else {
                 LogMsg(LOG_ERR, "select() returned -1, errno = %d\n", errno);
                 exit(1);
             }
-        } else if (sel <= 0) {
-            continue;
         }
 
+        // read CAN frames, routing them through the gateway first
+        for (b = 0; b < CAN_MAX_BUSES; b++) {
+            if ((buses[b].fd >= 0) && FD_ISSET(buses[b].fd, &readFdSet) &&
+                (canBusReceive(buses, b, canPort, cfg, txns, tioClients) < 0)) {
+                /* the socket is closed, its queued frames have nowhere to go */
+                LogMsg(LOG_ERR, "can%d: socket failed, %d queued frames "
+                    "dropped\n", b, buses[b].txQueue->count);
+                FD_CLR(buses[b].fd, &currFdSet);
+                buses[b].fd = -1;
+                canTxQueueInit(buses[b].txQueue, buses[b].txQueue->clientQuota);
+            }
+        }
+
+        /* routed and rule frames go out now, not behind the clients */
+        for (b = 0; b < CAN_MAX_BUSES; b++) {
+            canBusFlush(&buses[b]);
+        }
 
-        if (FD_ISSET(connectedServerFd, &readFdSet)) {
-            // read CAN frames
-            char msgBuff[128];
-            const int readCount = canServerSocketRead(connectedServerFd, msgBuff);
-            if (readCount > 0) {
-                if (connectedTIOFd >= 0)
-                {
-                    canTioSocketWrite(connectedTIOFd, msgBuff);
-                    n = max(connectedTIOFd, connectedServerFd)  + 1;
-                }
+        if (j1939->dataFd >= 0) {
+            if (FD_ISSET(j1939->claimFd, &readFdSet)) {
+                canJ1939ClaimRead(j1939, canNowUs());
+            }
+            canJ1939Poll(j1939, canNowUs());
+            if (FD_ISSET(j1939->dataFd, &readFdSet)) {
+                canJ1939Receive(j1939, tioClients);
+            }
+        }
+
+        /* transactions whose responses did not all come in time */
+        canTxnDeliver(tioClients, batch->txnEvents,
+                      canTxnExpire(txns, canNowUs(), batch->txnEvents));
+
+        /* the control thread published a configuration or wants stats */
+        if (FD_ISSET(wakeFd, &readFdSet)) {
+            char wake[16];
+            const ssize_t len = read(wakeFd, wake, sizeof(wake));
+
+            if ((len > 0) && (memchr(wake, 's', len) != 0)) {
+                dumpStats = 1;
             }
         }
 
         /* check for a new tio connection to accept */
         if (FD_ISSET(listenTIOFd, &readFdSet)) {
             /* new connection is here, accept it */
-            connectedTIOFd = canTioSocketAccept(listenTIOFd, addressTIOFamily);
+            const int connectedTIOFd = canTioSocketAccept(listenTIOFd,
+                                                          addressTIOFamily);
             if (connectedTIOFd >= 0) {
-                FD_CLR(listenTIOFd, &currFdSet);
+                int used = 0;
+
+                for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+                    if (tioClients[i].fd < 0) {
+                        break;
+                    }
+                }
+                canTioClientInit(&tioClients[i], connectedTIOFd);
                 FD_SET(connectedTIOFd, &currFdSet);
-                n = max(connectedTIOFd, connectedServerFd)  + 1;
+
+                /* stop accepting while every slot is taken */
+                for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+                    used += (tioClients[i].fd >= 0);
+                }
+                clientsHighWater = max(clientsHighWater, used);
+                if (used == CAN_MAX_CLIENTS) {
+                    FD_CLR(listenTIOFd, &currFdSet);
+                }
             }
         }
 
-        /* check for packet received on the tio socket */
-        if ((connectedTIOFd >= 0) && FD_ISSET(connectedTIOFd, &readFdSet)) {
+        /* check for packets received on the tio sockets */
+        for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+            canTioClient_t *client = &tioClients[i];
+
+            if (client->fd < 0) {
+                continue;
+            }
+            if (FD_ISSET(client->fd, &writeFdSet)) {
+                canTioSocketFlush(client);
+            }
+
             /* connected tio_agent has something to relay to can bus */
-            char msgBuff[128];
-            const int readCount = canTioSocketRead(connectedTIOFd, msgBuff,
-                                                   sizeof(msgBuff));
-            if (readCount < 0) {
-                FD_CLR(connectedTIOFd, &currFdSet);
+            if (!client->failed && FD_ISSET(client->fd, &readFdSet)) {
+                canTioMsg_t *const msgs = batch->msgs;
+                const int msgCount = canTioSocketRead(client, msgs,
+                                                      CAN_TIO_MAX_MSGS);
+                if (msgCount > 0) {
+                    /* everything from this read is queued, then sent as a batch */
+                    const int dropped = canQueueClientMsgs(clientQueue, txns,
+                                                           j1939, tioClients, i,
+                                                           msgs, msgCount);
+                    if (dropped > 0) {
+                        LogMsg(LOG_ERR, "tx queue: %d frames from client %d dropped\n",
+                            dropped, i);
+                    }
+                }
+            }
+
+            /* closed, or failed to keep up with what was written to it */
+            if (client->failed) {
+                FD_CLR(client->fd, &currFdSet);
                 FD_SET(listenTIOFd, &currFdSet);
-                n = max(listenTIOFd, connectedServerFd) + 1;
-                connectedTIOFd = -1;
-            } else if (readCount > 0) {
-                if (connectedServerFd >= 0)
-                    canServerSocketWrite(connectedServerFd, msgBuff);
+                canTioClientClose(client);
+                canTxQueueReleaseClient(clientQueue, i);
+                canTxnReleaseClient(txns, i);
+                canJ1939ReleaseClient(j1939, i);
             }
         }
 
+        /* and what the clients queued */
+        for (b = 0; b < CAN_MAX_BUSES; b++) {
+            canBusFlush(&buses[b]);
+        }
+
+        canLocalCaptureFlush();
+
+        /* last, so nothing read in this pass is left unhandled */
+        if ((handoverFd >= 0) && FD_ISSET(handoverFd, &readFdSet) &&
+            (canHandOver(handoverFd, canPort, listenTIOFd, buses, tioClients,
+                         txns, j1939) == 0)) {
+            LogMsg(LOG_NOTICE, "handed over to the new agent, exiting\n");
+            handedOver = 1;
+            keepGoing = 0;
+        }
+
     } /* end while */
 
     LogMsg(LOG_INFO, "cleaning up\n");
 
-    if (connectedTIOFd >= 0) {
-        close(connectedTIOFd);
+    for (i = 0; i < CAN_MAX_CLIENTS; i++) {
+        if (tioClients[i].fd >= 0) {
+            close(tioClients[i].fd);
+        }
     }
     if (listenTIOFd >= 0) {
         close(listenTIOFd);
     }
 
-    if (connectedServerFd >= 0) {
-        close(connectedServerFd);
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        if (buses[b].fd >= 0) {
+            close(buses[b].fd);
+        }
+    }
+
+    canJ1939Close(j1939);
+    if (handoverFd >= 0) {
+        close(handoverFd);
     }
+    canLocalCaptureStop();
+
+    /* the socket files and interfaces belong to the new agent now */
+    if (handedOver) {
+        return;
+    }
+
+    unlink(CAN_AGENT_HANDOVER_SOCKET);
+    canControlStop(CAN_AGENT_CONTROL_SOCKET);
 
     /* best effort removal of socket */
     const int rv = unlink(unixSocketPath);
@@ -285,17 +1299,26 @@ static void canAgent(unsigned short canPort, int baudRate, const char *unixSocke
         LogMsg(LOG_INFO, "socket file %s unlink failed\n", unixSocketPath);
     }
 
-    if (network_close(ep) < 0)
+    /* the clients' bus goes last, it unloads the driver */
+    for (b = 0; b < CAN_MAX_BUSES; b++) {
+        if ((b != canPort) && (network_close(buses[b].ep) < 0))
+        {
+            LogMsg(LOG_INFO, "network close failed.\n");
+        }
+    }
+    if (network_close(buses[canPort].ep) < 0)
     {
         LogMsg(LOG_INFO, "network close failed.\n");
     }
-
 }
 
 /****************************************************************************
  * network_open
+ *
+ * Only the first interface opened reloads the flexcan module; further
+ * interfaces (gateway buses) get their bitrate set and are brought up.
  */
-static ethIf_t * network_open(uint8_t instance, int baudRate)
+static ethIf_t * network_open(uint8_t instance, int baudRate, int loadModule)
 {
     ethIf_t *ep = NULL;
     char if_name[32];
@@ -307,44 +1330,57 @@ static ethIf_t * network_open(uint8_t instance, int baudRate)
     sprintf(if_name, "can%d", instance);
 
     n = sizeof(*ep);
-    if ((ep = malloc(n)) == NULL)
+    if ((ep = canPoolGet(&interfacePool)) == NULL)
     {
-        LogMsg(LOG_ERR, "Error: %s: malloc(%d) failed: %s [%d]\n", __FUNCTION__, n, strerror(errno), errno);
+        LogMsg(LOG_ERR, "Error: %s: no free interface\n", __FUNCTION__);
         exit(1);
     }
     memset(ep, 0, n);
 
     strcpy(ep->if_name, if_name);
 
-    // Load flexcan
-    sprintf(cmd, "modprobe flexcan && rmmod flexcan");
-    rv = execute_cmd_ex(cmd, NULL, 0);
-    if (rv < 0)
+    if (loadModule)
     {
-        LogMsg(LOG_ERR, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
-        exit(1);
-    }
-    LogMsg(LOG_INFO, "cmd run: modprobe flexcan && rmmod flexcan\n");
+        // Load flexcan
+        sprintf(cmd, "modprobe flexcan && rmmod flexcan");
+        rv = execute_cmd_ex(cmd, NULL, 0);
+        if (rv < 0)
+        {
+            LogMsg(LOG_ERR, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
+            exit(1);
+        }
+        LogMsg(LOG_INFO, "cmd run: modprobe flexcan && rmmod flexcan\n");
 
-    sprintf(cmd, "modprobe flexcan");
-    rv = execute_cmd_ex(cmd, NULL, 0);
-    if (rv < 0)
-    {
-        LogMsg(LOG_ERR, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
-        exit(1);
-    }
-    LogMsg(LOG_INFO, "cmd run: modprobe flexcan\n");
+        sprintf(cmd, "modprobe flexcan");
+        rv = execute_cmd_ex(cmd, NULL, 0);
+        if (rv < 0)
+        {
+            LogMsg(LOG_ERR, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
+            exit(1);
+        }
+        LogMsg(LOG_INFO, "cmd run: modprobe flexcan\n");
 
 
-    sprintf(cmd, "echo %d >  /sys/devices/platform/FlexCAN.0/bitrate", baudRate);
-    if (execute_cmd_ex(cmd, NULL, 0) < 0)
+        sprintf(cmd, "echo %d >  /sys/devices/platform/FlexCAN.0/bitrate", baudRate);
+        if (execute_cmd_ex(cmd, NULL, 0) < 0)
+        {
+            fprintf(stderr, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
+            exit(1);
+        }
+        LogMsg(LOG_INFO, "cmd run: echo %d >  /sys/devices/platform/FlexCAN.0/bitrate\n", baudRate);
+
+        ep->flags |= _NET_CAN_LOADED;
+    }
+    else
     {
-        fprintf(stderr, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
-        exit(1);
+        sprintf(cmd, "echo %d >  /sys/devices/platform/FlexCAN.%d/bitrate", baudRate, instance);
+        if (execute_cmd_ex(cmd, NULL, 0) < 0)
+        {
+            fprintf(stderr, "Error: %s: execute_cmd('%s') failed: %s [%d]\n", __FUNCTION__, cmd, strerror(errno), errno);
+            exit(1);
+        }
+        LogMsg(LOG_INFO, "cmd run: %s\n", cmd);
     }
-    LogMsg(LOG_INFO, "cmd run: echo %d >  /sys/devices/platform/FlexCAN.0/bitrate\n", baudRate);
-
-    ep->flags |= _NET_CAN_LOADED;
 
     sprintf(cmd, "ifconfig %s up", if_name);
     rv = execute_cmd_ex(cmd, NULL, 0);
@@ -399,7 +1435,7 @@ static int network_close(ethIf_t *ep)
             LogMsg(LOG_INFO, "cmd run: rmmod flexcan\n");
         }
 
-        free(ep);
+        canPoolPut(&interfacePool, ep);
         ep = NULL;
     }
 
@@ -407,6 +1443,115 @@ static int network_close(ethIf_t *ep)
 }
 
 
+/****************************************************************************
+ * network_attr
+ *
+ * Appends a netlink attribute to a request; a nested attribute gets its
+ * length fixed up once its contents follow.
+ */
+static struct rtattr *network_attr(struct nlmsghdr *nh, int type,
+                                   const void *data, int len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len > 0)
+    {
+        memcpy(RTA_DATA(rta), data, len);
+    }
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+/****************************************************************************
+ * network_restart
+ *
+ * Restarts the controller after bus-off the way "ip link set canX type
+ * can restart" does, with one IFLA_CAN_RESTART request on a netlink
+ * socket rather than a command: nothing forks, and the kernel has
+ * answered by the time send() returns.  The interface stays up and the
+ * sockets bound to it keep working.  A controller that came out of
+ * bus-off on its own answers EBUSY, which counts as restarted.
+ */
+static int network_restart(ethIf_t *ep)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+        char attrs[64];
+    } req;
+    union {
+        struct nlmsghdr nh;
+        char buf[256];
+    } ack;
+    struct sockaddr_nl kernel;
+    struct rtattr *linkInfo;
+    struct rtattr *data;
+    const uint32_t restart = 1;
+    struct nlmsgerr *err;
+    ssize_t len;
+    int fd;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = if_nametoindex(ep->if_name);
+    if (req.ifi.ifi_index == 0)
+    {
+        LogMsg(LOG_ERR, "Error: %s: no interface %s\n", __FUNCTION__, ep->if_name);
+        return -1;
+    }
+
+    linkInfo = network_attr(&req.nh, IFLA_LINKINFO, NULL, 0);
+    network_attr(&req.nh, IFLA_INFO_KIND, "can", 3);
+    data = network_attr(&req.nh, IFLA_INFO_DATA, NULL, 0);
+    network_attr(&req.nh, IFLA_CAN_RESTART, &restart, sizeof(restart));
+    data->rta_len = (char *)&req + req.nh.nlmsg_len - (char *)data;
+    linkInfo->rta_len = (char *)&req + req.nh.nlmsg_len - (char *)linkInfo;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+    {
+        LogMsg(LOG_ERR, "Error: %s: netlink socket() failed: %s [%d]\n", __FUNCTION__, strerror(errno), errno);
+        return -1;
+    }
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *)&kernel,
+               sizeof(kernel)) < 0)
+    {
+        LogMsg(LOG_ERR, "Error: %s: netlink send failed: %s [%d]\n", __FUNCTION__, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+    len = recv(fd, &ack, sizeof(ack), MSG_DONTWAIT);
+    close(fd);
+
+    if ((len < (ssize_t)NLMSG_LENGTH(sizeof(*err))) ||
+        (ack.nh.nlmsg_type != NLMSG_ERROR))
+    {
+        LogMsg(LOG_ERR, "Error: %s: no answer to the restart of %s\n", __FUNCTION__, ep->if_name);
+        return -1;
+    }
+    err = NLMSG_DATA(&ack.nh);
+    if (err->error == -EBUSY)
+    {
+        LogMsg(LOG_INFO, "%s: %s is not bus-off any more\n", __FUNCTION__, ep->if_name);
+    }
+    else if (err->error != 0)
+    {
+        LogMsg(LOG_ERR, "Error: %s: restart of %s refused: %s [%d]\n", __FUNCTION__, ep->if_name, strerror(-err->error), -err->error);
+        return -1;
+    }
+    LogMsg(LOG_INFO, "restart requested: %s\n", ep->if_name);
+
+    return 0;
+}
+
+
 /****************************************************************************
  * execute_cmd_ex
  */
@@ -414,8 +1559,7 @@ static int execute_cmd_ex(const char *cmd, char *result, int result_size)
 {
     int status = 0;
     FILE *fp = NULL;
-    char *icmd = NULL;
-    int n;
+    char icmd[CAN_BUFFER_SIZE];
 
 
     if ((result != NULL) && (result_size > 0))
@@ -423,15 +1567,13 @@ static int execute_cmd_ex(const char *cmd, char *result, int result_size)
         *result = '\0';
     }
 
-    n = strlen(cmd) + 16;
-    if ((icmd = malloc(n)) == NULL)
+    /* bus-off restarts run commands too, so no malloc() here */
+    if (snprintf(icmd, sizeof(icmd), "%s 2>&1", cmd) >= (int)sizeof(icmd))
     {
-        fprintf(stderr, "Error: %s: malloc(%d) failed: %s [%d]\n", __FUNCTION__, n, strerror(errno), errno);
+        fprintf(stderr, "Error: %s: command '%s' too long\n", __FUNCTION__, cmd);
         status = -1;
         goto e_execute_cmd_ex;
     }
-    strcpy(icmd, cmd);
-    strcat(icmd, " 2>&1");
 
     if ((fp = popen(icmd, "r")) != NULL)
     {
@@ -505,12 +1647,6 @@ static int execute_cmd_ex(const char *cmd, char *result, int result_size)
     }
 
 e_execute_cmd_ex:
-    if (icmd != NULL)
-    {
-        free(icmd);
-        icmd = NULL;
-    }
-
     return status;
 }
 
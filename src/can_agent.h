@@ -4,30 +4,639 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <linux/can.h>
+
+/* J1939 payloads up to the TP limit go through the agent */
+#define CAN_J1939_MAX_DATA 1785
+/* "J<pgn>,<sa>,<da>,<prio>#" and the payload as hex digits */
+#define CAN_J1939_MAX_LINE (16 + 2 * CAN_J1939_MAX_DATA + 1)
+
+/* big enough for a J1939 line at CAN_J1939_MAX_DATA */
+#define CAN_TIO_RX_BUFFER_SIZE 4096
+/* every message needs at least one byte and a terminator */
+#define CAN_TIO_MAX_MSGS (CAN_TIO_RX_BUFFER_SIZE / 2)
+/* enough frames to carry the longest message the parser can return */
+#define CAN_TIO_MAX_FRAMES (CAN_TIO_RX_BUFFER_SIZE / CAN_MAX_DLEN)
+/* output a client has not taken yet, a few receive batches */
+#define CAN_TIO_TX_BUFFER_SIZE 16384
+/* frames handed to the controller with one sendmmsg() call */
+#define CAN_TX_BATCH_SIZE 32
+
+/* one framed message parsed in place from a client's receive buffer */
+typedef struct {
+    char *data;
+    size_t len;
+} canTioMsg_t;
+
+/* per-client state of the TIO stream parser */
+typedef struct {
+    int fd;
+    char rxBuff[CAN_TIO_RX_BUFFER_SIZE];
+    size_t rxLen;       /* bytes held in rxBuff */
+    size_t rxStart;     /* first byte not yet handed out as a message */
+    int discarding;     /* dropping an oversized message until a terminator */
+    int relay;          /* gets the stream of received frames */
+    char txBuff[CAN_TIO_TX_BUFFER_SIZE];
+    size_t txLen;       /* bytes in txBuff the socket has not taken yet */
+    int failed;         /* gone or too slow, the main loop drops it */
+} canTioClient_t;
+
+#define CAN_MAX_CLIENTS 4
+#define CAN_TX_QUEUE_DEPTH 256
+/* retry delay after the controller refuses frames with ENOBUFS */
+#define CAN_TX_BACKOFF_US 1000
+
+/* one frame waiting in the transmit queue */
+typedef struct {
+    struct can_frame frame;
+    uint32_t key;       /* arbitration priority, lower goes first */
+    uint32_t seq;       /* keeps FIFO order among equal keys */
+    int client;         /* client slot that queued it, -1 for none */
+    uint64_t enqueueUs;
+    uint64_t originUs;  /* receive time of a forwarded frame, else 0 */
+} canTxEntry_t;
+
+typedef struct {
+    int depthHighWater;
+    uint64_t sent;
+    uint64_t confirmed;     /* seen again through own-message loopback */
+    uint64_t unconfirmed;   /* never looped back, lost in the driver */
+    uint64_t waitTotalUs;   /* time spent queued in the agent */
+    uint64_t waitMaxUs;
+    uint64_t completeTotalUs;   /* write() until loopback */
+    uint64_t completeMaxUs;
+    uint64_t rejectedFull;
+    uint64_t rejectedQuota;
+    uint64_t retries;
+    uint64_t dropped;
+    uint64_t forwarded;     /* gateway frames, from reception to write() */
+    uint64_t fwdTotalUs;
+    uint64_t fwdMaxUs;
+} canTxStats_t;
+
+/* priority ordered frames waiting for one CAN bus */
+typedef struct {
+    canTxEntry_t heap[CAN_TX_QUEUE_DEPTH];
+    int count;
+    uint32_t seq;
+    int clientQuota;    /* most frames queued per client, 0 for no limit */
+    int clientCount[CAN_MAX_CLIENTS];
+    struct {
+        struct can_frame frame;
+        uint64_t sentUs;
+    } inflight[CAN_TX_QUEUE_DEPTH];
+    int inflightHead;
+    int inflightCount;
+    canTxStats_t stats;
+} canTxQueue_t;
+
+/* bus load history: 100 buckets of 100 ms */
+#define CAN_LOAD_BUCKET_US 100000
+#define CAN_LOAD_BUCKETS 100
+/* shortest time between two restarts after bus-off */
+#define CAN_RESTART_HOLDOFF_US 1000000
+
+/* receive overload is judged over windows of this length */
+#define CAN_OVERLOAD_WINDOW_US 100000
+/* overloaded windows in a row before shedding more */
+#define CAN_OVERLOAD_ENTER 3
+/* calm windows in a row before shedding less */
+#define CAN_OVERLOAD_EXIT 10
+
+/* what an overloaded bus sheds, each level adding to the one before */
+enum { CAN_SHED_NONE, CAN_SHED_IDS, CAN_SHED_STREAM };
+
+/* load estimate and controller error state of one CAN bus */
+typedef struct {
+    int bitrate;
+    uint32_t bucketBits[CAN_LOAD_BUCKETS];
+    int bucket;                 /* bucket being filled */
+    uint64_t bucketStartUs;
+    uint64_t rxFrames;
+    uint64_t rxBits;
+    uint64_t txFrames;
+    uint64_t txBits;
+    int state;                  /* enum can_state */
+    int txErrors;
+    int rxErrors;
+    uint64_t errorFrames;
+    uint64_t busOffCount;
+    uint64_t restarts;
+    /* receive overload, see canBusMonitorRxRead() */
+    uint32_t rxDropCount;       /* last SO_RXQ_OVFL count seen */
+    uint64_t rxKernelDrops;     /* frames the socket buffer had no room for */
+    uint64_t rxShed;            /* frames held back while degraded */
+    int shedLevel;              /* one of the CAN_SHED_ values */
+    uint64_t windowStartUs;
+    int windowReads;
+    int windowFullReads;        /* reads that filled the whole batch */
+    int windowDrops;
+    int hotWindows;             /* overloaded windows in a row */
+    int calmWindows;
+    uint32_t gapDrops;          /* kernel drops and shed frames the */
+    uint32_t gapShed;           /* clients have not been told about yet */
+} canBusMonitor_t;
+
+#define CAN_MAX_BUSES 4
+#define CAN_GW_MAX_ROUTES 256
+/* route index entries for the dispatch chains */
+#define CAN_GW_CHAIN_SIZE 8192
+
+/* the most routes or rules one dispatch table leads to */
+#define CAN_DISPATCH_MAX_KEYS CAN_GW_MAX_ROUTES
+/* twice the most exact extended keys there can be */
+#define CAN_DISPATCH_HASH_SLOTS (2 * CAN_DISPATCH_MAX_KEYS)
+/* ends a chain, and marks a table entry without one */
+#define CAN_DISPATCH_NONE 0xFFFF
+#define CAN_DISPATCH_EMPTY 0xFFFFFFFFU
+
+/* the bus and IDs a route or rule is about */
+typedef struct {
+    int bus;
+    canid_t id;         /* with CAN_EFF_FLAG for extended IDs */
+    canid_t mask;
+} canDispatchKey_t;
+
+/* an exact extended ID in a hash table, id CAN_DISPATCH_EMPTY when free */
+typedef struct {
+    canid_t id;
+    int bus;
+    uint16_t chain;
+} canDispatchSlot_t;
+
+/* the routes or rules per bus and ID, see can_dispatch.c */
+typedef struct {
+    /* chain start per bus and standard ID */
+    uint16_t sff[CAN_MAX_BUSES][CAN_SFF_MASK + 1];
+    /* chain start of the masked extended keys per bus */
+    uint16_t effMasked[CAN_MAX_BUSES];
+    /* exact extended IDs, open addressing */
+    canDispatchSlot_t effHash[CAN_DISPATCH_HASH_SLOTS];
+    int effHashSize;    /* slots in use, a power of two */
+    /* key index lists, each ended by CAN_DISPATCH_NONE, in the owner's space */
+    uint16_t *chains;
+    int chainLen;
+    int chainSize;
+} canDispatch_t;
+
+/* one gateway route, see can_gateway.c for the file format */
+typedef struct {
+    int srcBus;
+    int dstBus;
+    canid_t id;         /* with CAN_EFF_FLAG for extended routes */
+    canid_t mask;
+    int rewrite;        /* replace the masked ID bits with newId */
+    canid_t newId;
+    int mapLen;         /* outgoing payload length, -1 to keep the payload */
+    int8_t map[CAN_MAX_DLEN];   /* source byte per outgoing byte, -1 for 0 */
+} canRoute_t;
+
+/* compiled routing table */
+typedef struct {
+    int routeCount;
+    canRoute_t routes[CAN_GW_MAX_ROUTES];
+    uint32_t busMask;   /* buses the routes use */
+    canDispatch_t dispatch; /* routes per source bus and ID */
+    uint16_t chains[CAN_GW_CHAIN_SIZE];
+} canGateway_t;
+
+/* a configuration being loaded next to the one in use */
+#define CAN_GW_SLOTS 2
+
+#define CAN_RULES_MAX 64
+#define CAN_RULE_MAX_CONDS 4
+/* rule index entries for the dispatch chains */
+#define CAN_RULE_CHAIN_SIZE 2048
+#define CAN_RULE_MAX_PATH 64
+/* frames waiting to be written to a capture file */
+#define CAN_CAPTURE_BUFFER_SIZE 16384
+/* "(<seconds>.<micro>) can<n> " and the frame as a candump line */
+#define CAN_CAPTURE_MAX_LINE (40 + CAN_TEXT_MAX_LINE)
+/* "!rule <name> " and the frame as a candump line */
+#define CAN_RULE_MAX_LINE (6 + 16 + CAN_TEXT_MAX_LINE + 1)
+
+enum { CAN_COND_DATA, CAN_COND_SIGNAL };
+enum { CAN_OP_EQ, CAN_OP_NE, CAN_OP_LT, CAN_OP_LE, CAN_OP_GT, CAN_OP_GE };
+enum { CAN_CAPTURE_NONE, CAN_CAPTURE_START, CAN_CAPTURE_STOP };
+
+/* one condition on the payload of a frame, see can_local.c */
+typedef struct {
+    uint8_t kind;       /* CAN_COND_DATA or CAN_COND_SIGNAL */
+    uint8_t op;         /* CAN_OP_ value for a signal */
+    uint8_t shift;      /* signal position in the 64 bit payload */
+    uint8_t bigEndian;
+    uint8_t isSigned;
+    uint64_t mask;      /* payload bits, or signal bits after the shift */
+    int64_t value;
+} canRuleCond_t;
+
+/* one trigger/action rule */
+typedef struct {
+    char name[16];
+    int bus;
+    canid_t id;         /* with CAN_EFF_FLAG for extended frames */
+    canid_t mask;
+    int condCount;
+    canRuleCond_t conds[CAN_RULE_MAX_CONDS];
+    uint64_t holdoffUs; /* shortest time between two firings */
+    int sendBus;        /* -1 without a frame to send */
+    struct can_frame send;
+    int notify;         /* tell the clients */
+    int capture;        /* CAN_CAPTURE_ value */
+    char capturePath[CAN_RULE_MAX_PATH];
+} canRule_t;
+
+/* compiled rule set */
+typedef struct {
+    uint32_t serial;    /* tells rule sets apart, see canLocalMatch() */
+    uint32_t busMask;   /* buses the rules read or send on */
+    int ruleCount;
+    canRule_t rules[CAN_RULES_MAX];
+    canDispatch_t dispatch; /* rules per bus and ID */
+    uint16_t chains[CAN_RULE_CHAIN_SIZE];
+} canRules_t;
+
+#define CAN_CFG_MAX_FILTERS 64
+#define CAN_CFG_MAX_LIMITS 64
+
+/* an ID match, id carries CAN_EFF_FLAG for extended IDs */
+typedef struct {
+    canid_t id;
+    canid_t mask;
+} canIdMask_t;
+
+typedef struct {
+    canIdMask_t match;
+    uint32_t perSecond;
+    uint32_t burst;
+    uint64_t tokens;    /* token bucket, CAN_RATE_SCALE per frame */
+    uint64_t lastUs;
+    uint64_t dropped;
+} canRateLimit_t;
+
+/* the one being used and the one being loaded */
+#define CAN_CFG_SLOTS 2
+
+/* run time configuration, replaced as a whole on reload */
+typedef struct {
+    canGateway_t *gateway;      /* 0 without routes */
+    canRules_t *rules;          /* 0 without rules */
+    int filterCount;            /* 0: relay everything to the clients */
+    uint32_t sffFilter[(CAN_SFF_MASK + 1) / 32];
+    int effFilterCount;
+    canIdMask_t effFilters[CAN_CFG_MAX_FILTERS];
+    int limitCount;
+    canRateLimit_t limits[CAN_CFG_MAX_LIMITS];
+    uint8_t sffLimit[CAN_SFF_MASK + 1];     /* limit index + 1, 0 for none */
+    int rcvBuf;                 /* SO_RCVBUF of the CAN sockets, 0 to leave */
+    uint32_t sffShed[(CAN_SFF_MASK + 1) / 32];  /* first to go in overload */
+    int effShedCount;
+    canIdMask_t effShed[CAN_CFG_MAX_FILTERS];
+} canConfig_t;
+
+/* a frame the gateway forwards */
+typedef struct {
+    int bus;
+    struct can_frame frame;
+} canGwOut_t;
+
+#define CAN_TXN_MAX 64
+#define CAN_TXN_WHEEL_SLOTS 256
+#define CAN_TXN_TICK_US 1000
+#define CAN_TXN_NONE -1
+/* exact response IDs, twice the most transactions there can be */
+#define CAN_TXN_INDEX_SLOTS (2 * CAN_TXN_MAX)
+
+/* a client's request waiting for its responses */
+typedef struct {
+    int client;             /* -1 while the slot is free */
+    uint32_t tag;           /* chosen by the client, echoed in the replies */
+    canIdMask_t match;      /* the response IDs */
+    int maxResponses;       /* 0: collect until the timeout */
+    int responses;
+    uint64_t expiryTick;
+    int16_t next;           /* timer wheel slot list, or the free list */
+    int16_t prev;
+    int16_t idNext;         /* the others waiting for the same ID, or */
+    int16_t idPrev;         /* the masked list */
+} canTxn_t;
+
+/* a transaction request as the client writes it */
+typedef struct {
+    uint32_t tag;
+    struct can_frame frame;
+    canIdMask_t match;
+    uint32_t timeoutMs;
+    int maxResponses;
+} canTxnRequest_t;
+
+typedef struct {
+    canTxn_t txns[CAN_TXN_MAX];
+    int16_t wheel[CAN_TXN_WHEEL_SLOTS];     /* list heads, by expiry tick */
+    /* list heads by exact response ID, open addressing */
+    canDispatchSlot_t index[CAN_TXN_INDEX_SLOTS];
+    int16_t masked;         /* list head of the masked response IDs */
+    int16_t freeList;
+    int active;
+    int highWater;          /* most transactions in flight at once */
+    uint64_t tick;          /* the last tick expired */
+    uint64_t nextTick;      /* when to look again, 0 to work it out */
+    uint64_t started;
+    uint64_t completed;
+    uint64_t timedOut;
+    uint64_t cancelled;
+    uint64_t responses;
+} canTxnTable_t;
+
+enum { CAN_TXN_RESPONSE, CAN_TXN_DONE, CAN_TXN_TIMEOUT, CAN_TXN_ERROR };
+
+/* something to tell the client that owns a transaction */
+typedef struct {
+    int client;
+    uint32_t tag;
+    int kind;               /* one of the CAN_TXN_ values above */
+    struct can_frame frame; /* the response */
+} canTxnEvent_t;
+
+#define CAN_J1939_MAX_SUBS 16
+/* quiet time after an address claim before the address may be used */
+#define CAN_J1939_CLAIM_US 250000
+
+/* a client's subscription to J1939 messages */
+typedef struct {
+    uint32_t pgn;
+    uint32_t pgnMask;       /* 0 for every PGN */
+    int sa;                 /* source address, -1 for any */
+} canJ1939Sub_t;
+
+/* a J1939 message, reassembled by the kernel if it came in pieces */
+typedef struct {
+    uint32_t pgn;
+    uint8_t sa;
+    uint8_t da;             /* 0xFF for broadcast */
+    uint8_t prio;
+    int len;
+    uint8_t data[CAN_J1939_MAX_DATA];
+} canJ1939Msg_t;
+
+enum { CAN_J1939_CLAIMING, CAN_J1939_CLAIMED, CAN_J1939_LOST };
+
+/* the agent's J1939 node on the clients' bus */
+typedef struct {
+    int claimFd;            /* address claims and requests for them */
+    int dataFd;             /* everything else, -1 without J1939 */
+    int ifindex;
+    uint64_t name;
+    uint8_t addr;           /* claimed or being claimed */
+    int state;              /* one of the CAN_J1939_ values above */
+    uint64_t claimUs;       /* when the last claim went out */
+    uint8_t used[256 / 8];  /* addresses claimed by other nodes */
+    int sendPrio;           /* last SO_J1939_SEND_PRIO set, -1 for none */
+    int subCount[CAN_MAX_CLIENTS];
+    canJ1939Sub_t subs[CAN_MAX_CLIENTS][CAN_J1939_MAX_SUBS];
+    uint64_t rxMsgs;
+    uint64_t txMsgs;
+    uint64_t txErrors;
+    uint64_t truncated;     /* longer than CAN_J1939_MAX_DATA */
+    uint64_t conflicts;     /* other nodes claiming our address */
+} canJ1939_t;
+
+/* memory budget for the pools when -m is not given */
+#define CAN_MEMORY_BUDGET (512 * 1024)
+#define CAN_POOL_MAX 8
+
+/* equal sized blocks carved from the memory budget, see can_pool.c */
+typedef struct {
+    const char *name;
+    size_t blockSize;
+    int count;
+    int used;
+    int highWater;      /* most blocks in use at once */
+    uint64_t failures;  /* gets from an empty pool */
+    void *freeList;
+} canPool_t;
+
+static inline uint64_t canNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* frames read from a CAN socket with one call */
+#define CAN_RX_BATCH_SIZE 32
+/* longest candump line: 8 digit ID, "##", flags, CAN FD payload, '\n' */
+#define CAN_TEXT_MAX_LINE (8 + 3 + 2 * CANFD_MAX_DLEN + 1)
+/* longest notice line sent to candump clients, e.g. "!gap 4294967295 kernel" */
+#define CAN_TEXT_MAX_NOTICE 32
+
+/* details of a received frame beyond its contents */
+typedef struct {
+    int ownMsg;         /* loopback copy of a frame this agent sent */
+    uint64_t rxUs;      /* kernel receive time on the canNowUs() clock */
+    uint32_t dropCount; /* the socket's SO_RXQ_OVFL count when it arrived */
+} canRxInfo_t;
 
 /* functions defined in can_server_socket.c */
 int canServerSocketInit(int instance);
-int canServerSocketRead(int newFd, char *msgBuff);
-void canServerSocketWrite(int socketFd, const char *buff);
+int canServerSocketReadBatch(int socketFd, struct can_frame *frames,
+    canRxInfo_t *infos, int maxFrames);
+int canServerSocketFormat(const struct can_frame *frame, char *msgBuff);
+int canServerSocketParse(const char *msg, size_t len,
+    struct can_frame *frames, int maxFrames);
+int canServerSocketWriteBatch(int socketFd, const struct can_frame *frames,
+    int count);
+void canServerSocketSetRcvBuf(int socketFd, int bytes);
+
+/* functions defined in can_text.c */
+int canTextFormat(const struct canfd_frame *frame, int mtu, char *out);
+size_t canTextFormatBatch(const struct can_frame *frames, int count, char *out);
+char *canTextHex(char *out, const uint8_t *data, int len);
+int canTextUnhex(const char *text, size_t len, uint8_t *data, int maxLen);
+int canTextParse(const char *text, size_t len, struct canfd_frame *frame);
+
+/* functions defined in can_transaction.c */
+void canTxnInit(canTxnTable_t *t, uint64_t nowUs);
+int canTxnParse(char *line, canTxnRequest_t *req);
+void canTxnStart(canTxnTable_t *t, int client, const canTxnRequest_t *req,
+    uint64_t nowUs);
+int canTxnMatch(canTxnTable_t *t, const struct can_frame *frame,
+    canTxnEvent_t *events);
+int canTxnExpire(canTxnTable_t *t, uint64_t nowUs, canTxnEvent_t *events);
+uint64_t canTxnNextUs(canTxnTable_t *t);
+void canTxnReleaseClient(canTxnTable_t *t, int client);
+int canTxnFormatEvent(const canTxnEvent_t *event, char *out);
+void canTxnLogStats(const canTxnTable_t *t);
 
+/* functions defined in can_j1939.c */
+int canJ1939Init(canJ1939_t *j, int instance, uint64_t name, int addr,
+    uint64_t nowUs);
+void canJ1939Close(canJ1939_t *j);
+void canJ1939ClaimRead(canJ1939_t *j, uint64_t nowUs);
+void canJ1939Poll(canJ1939_t *j, uint64_t nowUs);
+uint64_t canJ1939NextUs(const canJ1939_t *j);
+int canJ1939Read(canJ1939_t *j, canJ1939Msg_t *msg);
+int canJ1939Wanted(const canJ1939_t *j, int client, const canJ1939Msg_t *msg);
+int canJ1939Format(const canJ1939Msg_t *msg, char *out);
+int canJ1939Command(canJ1939_t *j, int client, char *args);
+int canJ1939Send(canJ1939_t *j, const char *line, size_t len);
+void canJ1939ReleaseClient(canJ1939_t *j, int client);
+void canJ1939LogStats(const canJ1939_t *j);
 
 /* functions defined in can_tio_socket.c */
 int canTioSocketInit(int *addressFamily,
     const char *unixSocketPath);
 int canTioSocketAccept(int serverFd, int addressFamily);
-int canTioSocketRead(int newFd, char *msgBuff, size_t bufferSize);
-void canTioSocketWrite(int socketFd, const char *buff);
+void canTioClientInit(canTioClient_t *client, int fd);
+void canTioClientClose(canTioClient_t *client);
+int canTioSocketRead(canTioClient_t *client, canTioMsg_t *msgs, int maxMsgs);
+int canTioSocketWrite(canTioClient_t *client, const char *buff);
+int canTioSocketFlush(canTioClient_t *client);
+void canTioSocketLogStats(void);
+
+/* functions defined in can_tx_queue.c */
+void canTxQueueInit(canTxQueue_t *q, int clientQuota);
+int canTxQueuePush(canTxQueue_t *q, const struct can_frame *frame,
+    int client, uint64_t originUs);
+int canTxQueueFlush(canTxQueue_t *q, int socketFd);
+void canTxQueueReleaseClient(canTxQueue_t *q, int client);
+void canTxQueueConfirm(canTxQueue_t *q, const struct can_frame *frame);
+void canTxQueueLogStats(const canTxQueue_t *q, const char *name);
+
+/* functions defined in can_bus_monitor.c */
+int canFrameBits(const struct can_frame *frame);
+void canBusMonitorInit(canBusMonitor_t *m, int bitrate);
+void canBusMonitorFrame(canBusMonitor_t *m, const struct can_frame *frame,
+    int tx, uint64_t nowUs);
+double canBusMonitorLoad(canBusMonitor_t *m, int windowBuckets, uint64_t nowUs);
+int canBusMonitorError(canBusMonitor_t *m, const struct can_frame *frame);
+void canBusMonitorRestarted(canBusMonitor_t *m);
+uint32_t canBusMonitorRxRead(canBusMonitor_t *m, int count, int full,
+    uint32_t dropCount, uint64_t nowUs);
+const char *canBusMonitorShedName(int level);
+void canBusMonitorLogStats(canBusMonitor_t *m, const char *name);
+
+/* functions defined in can_pool.c */
+int canArenaInit(size_t budget);
+void *canArenaAlloc(size_t size);
+int canArenaCheck(void);
+int canPoolInit(canPool_t *pool, const char *name, size_t blockSize, int count);
+void *canPoolGet(canPool_t *pool);
+void canPoolPut(canPool_t *pool, void *block);
+void canMemoryLogStats(void);
+
+/* functions defined in can_dispatch.c */
+canDispatchSlot_t *canDispatchFind(canDispatchSlot_t *slots, int size,
+    int bus, canid_t id);
+void canDispatchInit(canDispatch_t *d, uint16_t *chains, int chainSize);
+int canDispatchCompile(canDispatch_t *d, const canDispatchKey_t *keys,
+    int count);
+
+static inline uint32_t canDispatchHash(int bus, canid_t id)
+{
+    return ((id & CAN_EFF_MASK) * 2654435761U) ^ (bus * 40503U);
+}
+
+/*
+ * Returns the chain of keys whose ID matches a frame's exactly or, for a
+ * standard ID, through the mask; 0 if there is none.
+ */
+static inline const uint16_t *canDispatchLookup(const canDispatch_t *d,
+    int bus, canid_t id)
+{
+    uint32_t slot;
+
+    if (!(id & CAN_EFF_FLAG)) {
+        const int start = d->sff[bus][id & CAN_SFF_MASK];
+        return (start != CAN_DISPATCH_NONE) ? d->chains + start : 0;
+    }
+
+    id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    slot = canDispatchHash(bus, id) & (d->effHashSize - 1);
+    while (d->effHash[slot].id != CAN_DISPATCH_EMPTY) {
+        if ((d->effHash[slot].id == id) && (d->effHash[slot].bus == bus)) {
+            return d->chains + d->effHash[slot].chain;
+        }
+        slot = (slot + 1) & (d->effHashSize - 1);
+    }
+    return 0;
+}
+
+/*
+ * Returns the masked extended keys of a bus, for the caller to match
+ * against an extended ID one by one; 0 for a standard ID or none.
+ */
+static inline const uint16_t *canDispatchMasked(const canDispatch_t *d,
+    int bus, canid_t id)
+{
+    if (!(id & CAN_EFF_FLAG) || (d->effMasked[bus] == CAN_DISPATCH_NONE)) {
+        return 0;
+    }
+    return d->chains + d->effMasked[bus];
+}
+
+/* functions defined in can_gateway.c */
+int canGatewayPoolInit(void);
+canGateway_t *canGatewayCreate(void);
+int canGatewayAddRoute(canGateway_t *gw, char *line);
+int canGatewayReadFile(canGateway_t *gw, const char *path);
+int canGatewayCompile(canGateway_t *gw);
+void canGatewayFree(canGateway_t *gw);
+int canGatewayRoute(const canGateway_t *gw, int bus,
+    const struct can_frame *frame, canGwOut_t *out, int maxOut);
+
+/* functions defined in can_config.c */
+int canParseId(const char *text, canid_t *id, int *eff);
+int canParseIdMask(const char *text, canid_t *id, canid_t *mask);
+int canConfigPoolInit(void);
+canConfig_t *canConfigLoad(const char *configPath, const char *gatewayPath);
+void canConfigFree(canConfig_t *cfg);
+int canConfigPassClient(canConfig_t *cfg, const struct can_frame *frame,
+    uint64_t nowUs);
+int canConfigShed(const canConfig_t *cfg, const struct can_frame *frame);
+void canConfigLogStats(const canConfig_t *cfg);
+canConfig_t *canConfigGet(void);
+canConfig_t *canConfigPublish(canConfig_t *cfg);
+void canConfigQuiescent(void);
+unsigned long canConfigEpoch(void);
+
+/* functions defined in can_control.c */
+int canControlStart(const char *controlPath, const char *configPath,
+    const char *gatewayPath, uint32_t busMask);
+void canControlHangup(void);
+void canControlStop(const char *controlPath);
 
 /* functions defined in can_local.c */
-char *canHandleLocal(char *qmlString);
+int canLocalPoolInit(void);
+canRules_t *canLocalCreate(void);
+int canHandleLocal(canRules_t *rules, char *line);
+int canLocalCompile(canRules_t *rules);
+void canLocalFree(canRules_t *rules);
+int canLocalCheckBuses(const canRules_t *rules, uint32_t busMask);
+int canLocalMatch(const canRules_t *rules, int bus, const struct can_frame *frame,
+    uint64_t nowUs, const canRule_t **fired, int maxFired);
+int canLocalFormat(const canRule_t *rule, const struct can_frame *frame,
+    char *out);
+void canLocalCapture(const canRule_t *rule, uint64_t nowUs);
+void canLocalCaptureFrame(int bus, const struct can_frame *frame,
+    uint64_t rxUs);
+void canLocalCaptureFlush(void);
+void canLocalCaptureStop(void);
+void canLocalLogStats(const canRules_t *rules);
 
 /* functions exported from logmsg.c */
 void LogOpen(const char *ident, int logToSyslog, const char *logFilePath,
     int verboseFlag);
+void LogSetVerbose(int verboseFlag);
+void LogClose(void);
 void LogMsg(int level, const char *fmt, ...);
 
 #define CAN_DEFAULT_SERVER_AGENT_PORT 0
 #define CAN_AGENT_UNIX_SOCKET "/tmp/sioSocket"
+#define CAN_AGENT_CONTROL_SOCKET "/tmp/canAgentControl"
+#define CAN_AGENT_HANDOVER_SOCKET "/tmp/canAgentHandover"
 
 #define CAN_BUFFER_SIZE 256
 #define CAN_BAUD_RATE 1000000
@@ -42,5 +651,49 @@ typedef struct {
     uint8_t flags;
 } ethIf_t;
 
+/* one CAN interface the agent has open */
+typedef struct {
+    int fd;                 /* raw socket, -1 when the bus is not used */
+    ethIf_t *ep;
+    canTxQueue_t *txQueue;  /* from the queue pool once the bus is open */
+    canBusMonitor_t monitor;
+    uint64_t txRetryUs;     /* backing off after ENOBUFS until then */
+    uint64_t restartUs;     /* bus-off restart is due then */
+    uint64_t lastRestartUs;
+    uint64_t gwDropped;     /* received frames the gateway could not queue */
+} canBus_t;
+
+/* the listener, the CAN sockets, the clients and the J1939 sockets */
+#define CAN_HANDOVER_MAX_FDS (1 + CAN_MAX_BUSES + CAN_MAX_CLIENTS + 2)
+
+/*
+ * Everything a running agent passes to the one replacing it.  The fd
+ * fields index the array of descriptors sent along, -1 for none.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;          /* sizeof(canHandover_t) of the sender */
+    int canPort;
+    int listenFd;
+    struct {
+        int fd;
+        ethIf_t ep;
+        canTxQueue_t txQueue;
+        canBusMonitor_t monitor;
+        uint64_t restartUs;
+        uint64_t lastRestartUs;
+        uint64_t gwDropped;
+    } buses[CAN_MAX_BUSES];
+    canTioClient_t clients[CAN_MAX_CLIENTS];
+    canTxnTable_t txns;
+    canJ1939_t j1939;
+} canHandover_t;
+
+/* functions defined in can_handover.c */
+int canHandoverListen(const char *path);
+int canHandoverSend(int listenFd, canHandover_t *state, const int *fds,
+    int fdCount);
+int canHandoverReceive(const char *path, int canPort, canHandover_t *state,
+    int *fds);
 
 #endif  /* CAN_AGENT_H */
@@ -0,0 +1,388 @@
+#include <string.h>
+#include <linux/can/error.h>
+#include <linux/can/netlink.h>
+
+#include "can_agent.h"
+
+/*
+ * Bus load is estimated from the exact on-the-wire length of every frame
+ * seen on the bus, received or sent by this agent, summed into fixed
+ * width time buckets.  Adding up the newest buckets gives the load over
+ * a sliding window.
+ */
+
+#define CAN_CRC15_POLY 0x4599
+
+/* appends the low `count` bits of value to bits[], most significant first */
+static int canPutBits(uint8_t *bits, int pos, uint32_t value, int count)
+{
+    while (count-- > 0) {
+        bits[pos++] = (value >> count) & 1;
+    }
+    return pos;
+}
+
+/**
+ * Computes the number of bits a classic CAN frame occupies on the bus:
+ * SOF, arbitration and control fields, data, CRC with the stuff bits
+ * the controller inserts into them, then CRC delimiter, ACK, EOF and
+ * intermission.  The stuff bits are counted from the real bit pattern,
+ * CRC included, rather than estimated.
+ *
+ * @param frame the frame as read from or written to the raw socket
+ *
+ * @return int the frame length in bit times
+ */
+int canFrameBits(const struct can_frame *frame)
+{
+    uint8_t bits[128];
+    const int rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+    const int dlc = (frame->can_dlc > 15) ? 15 : frame->can_dlc;
+    const int len = rtr ? 0 : ((dlc > CAN_MAX_DLEN) ? CAN_MAX_DLEN : dlc);
+    uint16_t crc = 0;
+    int pos = 0;
+    int stuffed = 0;
+    int run = 0;
+    int last = -1;
+    int i;
+
+    pos = canPutBits(bits, pos, 0, 1);      /* SOF */
+    if (frame->can_id & CAN_EFF_FLAG) {
+        const uint32_t id = frame->can_id & CAN_EFF_MASK;
+        pos = canPutBits(bits, pos, id >> 18, 11);
+        pos = canPutBits(bits, pos, 3, 2);  /* SRR, IDE */
+        pos = canPutBits(bits, pos, id & 0x3FFFF, 18);
+        pos = canPutBits(bits, pos, rtr, 1);
+        pos = canPutBits(bits, pos, 0, 2);  /* r1, r0 */
+    } else {
+        pos = canPutBits(bits, pos, frame->can_id & CAN_SFF_MASK, 11);
+        pos = canPutBits(bits, pos, rtr, 1);
+        pos = canPutBits(bits, pos, 0, 2);  /* IDE, r0 */
+    }
+    pos = canPutBits(bits, pos, dlc, 4);
+    for (i = 0; i < len; i++) {
+        pos = canPutBits(bits, pos, frame->data[i], 8);
+    }
+
+    for (i = 0; i < pos; i++) {
+        const int feedback = ((crc >> 14) & 1) ^ bits[i];
+        crc = (crc << 1) & 0x7FFF;
+        if (feedback) {
+            crc ^= CAN_CRC15_POLY;
+        }
+    }
+    pos = canPutBits(bits, pos, crc, 15);
+
+    /* a complementary bit follows every run of five equal bits */
+    for (i = 0; i < pos; i++) {
+        if (bits[i] == last) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5) {
+            stuffed++;
+            last = !last;
+            run = 1;
+        }
+    }
+
+    /* CRC delimiter, ACK slot and delimiter, EOF, intermission */
+    return pos + stuffed + 1 + 2 + 7 + 3;
+}
+
+/**
+ * Prepares the monitor for a bus running at the given bit rate.
+ */
+void canBusMonitorInit(canBusMonitor_t *m, int bitrate)
+{
+    memset(m, 0, sizeof(*m));
+    m->bitrate = (bitrate > 0) ? bitrate : CAN_BAUD_RATE;
+    m->state = CAN_STATE_ERROR_ACTIVE;
+    m->bucketStartUs = canNowUs();
+    m->bucketStartUs -= m->bucketStartUs % CAN_LOAD_BUCKET_US;
+}
+
+/* moves the current bucket forward to the one covering nowUs */
+static void canBusMonitorAdvance(canBusMonitor_t *m, uint64_t nowUs)
+{
+    uint64_t elapsed;
+
+    if (nowUs < m->bucketStartUs + CAN_LOAD_BUCKET_US) {
+        return;
+    }
+
+    elapsed = (nowUs - m->bucketStartUs) / CAN_LOAD_BUCKET_US;
+    if (elapsed >= CAN_LOAD_BUCKETS) {
+        /* quiet for longer than the whole history */
+        memset(m->bucketBits, 0, sizeof(m->bucketBits));
+        m->bucket = 0;
+    } else {
+        while (elapsed-- > 0) {
+            m->bucket = (m->bucket + 1) % CAN_LOAD_BUCKETS;
+            m->bucketBits[m->bucket] = 0;
+        }
+    }
+    m->bucketStartUs = nowUs - (nowUs % CAN_LOAD_BUCKET_US);
+}
+
+/**
+ * Accounts for one frame seen on the bus.
+ *
+ * @param m the bus monitor
+ * @param frame the data frame received or sent
+ * @param tx non-zero for a frame this agent transmitted
+ * @param nowUs the current canNowUs() time
+ */
+void canBusMonitorFrame(canBusMonitor_t *m, const struct can_frame *frame,
+    int tx, uint64_t nowUs)
+{
+    const int bits = canFrameBits(frame);
+
+    canBusMonitorAdvance(m, nowUs);
+    m->bucketBits[m->bucket] += bits;
+
+    if (tx) {
+        m->txFrames++;
+        m->txBits += bits;
+    } else {
+        m->rxFrames++;
+        m->rxBits += bits;
+    }
+}
+
+/**
+ * Returns the bus utilisation in percent over the most recent window.
+ *
+ * @param m the bus monitor
+ * @param windowBuckets the window length in CAN_LOAD_BUCKET_US buckets,
+ *        at most CAN_LOAD_BUCKETS
+ * @param nowUs the current canNowUs() time
+ */
+double canBusMonitorLoad(canBusMonitor_t *m, int windowBuckets, uint64_t nowUs)
+{
+    uint64_t bits = 0;
+    uint64_t windowUs;
+    int i;
+
+    canBusMonitorAdvance(m, nowUs);
+
+    /* the current bucket is only partly filled */
+    windowUs = (uint64_t)(windowBuckets - 1) * CAN_LOAD_BUCKET_US +
+               (nowUs - m->bucketStartUs);
+    for (i = 0; i < windowBuckets; i++) {
+        bits += m->bucketBits[(m->bucket + CAN_LOAD_BUCKETS - i) %
+                              CAN_LOAD_BUCKETS];
+    }
+
+    if (windowUs == 0) {
+        return 0.0;
+    }
+    return (100.0 * bits * 1000000) / ((double)m->bitrate * windowUs);
+}
+
+static const char *canStateName(int state)
+{
+    switch (state) {
+    case CAN_STATE_ERROR_ACTIVE:  return "error-active";
+    case CAN_STATE_ERROR_WARNING: return "error-warning";
+    case CAN_STATE_ERROR_PASSIVE: return "error-passive";
+    case CAN_STATE_BUS_OFF:       return "bus-off";
+    default:                      return "unknown";
+    }
+}
+
+/**
+ * Tracks the controller state from an error frame (CAN_ERR_FLAG set).
+ *
+ * @param m the bus monitor
+ * @param frame the error frame
+ *
+ * @return int 1 if the controller has just gone bus-off and needs a
+ *         restart, otherwise 0
+ */
+int canBusMonitorError(canBusMonitor_t *m, const struct can_frame *frame)
+{
+    const canid_t err = frame->can_id & CAN_ERR_MASK;
+    int state = m->state;
+
+    m->errorFrames++;
+
+    if (err & CAN_ERR_CRTL) {
+        const uint8_t ctrl = frame->data[1];
+
+        if (ctrl & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+            state = CAN_STATE_ERROR_PASSIVE;
+        } else if (ctrl & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+            state = CAN_STATE_ERROR_WARNING;
+        }
+#ifdef CAN_ERR_CRTL_ACTIVE
+        else if (ctrl & CAN_ERR_CRTL_ACTIVE) {
+            state = CAN_STATE_ERROR_ACTIVE;
+        }
+#endif
+    }
+    if (err & CAN_ERR_RESTARTED) {
+        state = CAN_STATE_ERROR_ACTIVE;
+    }
+    if (err & CAN_ERR_BUSOFF) {
+        state = CAN_STATE_BUS_OFF;
+    }
+#ifdef CAN_ERR_CNT
+    if (err & CAN_ERR_CNT) {
+        m->txErrors = frame->data[6];
+        m->rxErrors = frame->data[7];
+    }
+#endif
+
+    if (state == m->state) {
+        return 0;
+    }
+
+    LogMsg((state == CAN_STATE_ERROR_ACTIVE) ? LOG_NOTICE : LOG_ERR,
+        "CAN BUS: %s -> %s\n", canStateName(m->state), canStateName(state));
+    m->state = state;
+
+    if (state == CAN_STATE_BUS_OFF) {
+        m->busOffCount++;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Records a successful restart of the controller.  The driver's
+ * CAN_ERR_RESTARTED frame only comes through the socket later, and not
+ * at all when the controller had already recovered, so the state is set
+ * here; the next bus-off then shows up as a change again.
+ */
+void canBusMonitorRestarted(canBusMonitor_t *m)
+{
+    m->restarts++;
+    if (m->state != CAN_STATE_ERROR_ACTIVE) {
+        LogMsg(LOG_NOTICE, "CAN BUS: %s -> %s (restarted)\n",
+            canStateName(m->state), canStateName(CAN_STATE_ERROR_ACTIVE));
+        m->state = CAN_STATE_ERROR_ACTIVE;
+    }
+}
+
+/**
+ * Returns the name clients and the log use for a shed level.
+ */
+const char *canBusMonitorShedName(int level)
+{
+    switch (level) {
+    case CAN_SHED_NONE:   return "none";
+    case CAN_SHED_IDS:    return "ids";
+    case CAN_SHED_STREAM: return "stream";
+    default:              return "unknown";
+    }
+}
+
+/**
+ * Closes the overload window that started at m->windowStartUs and moves
+ * the shed level one step if enough windows in a row agree.  A window is
+ * overloaded when the socket dropped frames or when most of its reads
+ * filled the whole batch, so the agent only just kept up.
+ */
+static void canBusMonitorWindow(canBusMonitor_t *m, uint64_t nowUs)
+{
+    const int hot = (m->windowDrops > 0) ||
+                    ((m->windowReads >= 4) &&
+                     (2 * m->windowFullReads > m->windowReads));
+    /* windows without a single read went by calm */
+    const uint64_t idle = (nowUs - m->windowStartUs) / CAN_OVERLOAD_WINDOW_US - 1;
+    int level = m->shedLevel;
+
+    if (hot) {
+        m->calmWindows = 0;
+        if ((++m->hotWindows >= CAN_OVERLOAD_ENTER) && (level < CAN_SHED_STREAM)) {
+            level++;
+            m->hotWindows = 0;
+        }
+    } else {
+        m->calmWindows++;
+    }
+    if (idle > 0) {
+        m->hotWindows = 0;
+        m->calmWindows += (idle > CAN_OVERLOAD_EXIT) ? CAN_OVERLOAD_EXIT : idle;
+    }
+    if ((m->calmWindows >= CAN_OVERLOAD_EXIT) && (level > CAN_SHED_NONE)) {
+        level--;
+        m->calmWindows = 0;
+    }
+
+    if (level != m->shedLevel) {
+        LogMsg((level > m->shedLevel) ? LOG_ERR : LOG_NOTICE,
+            "CAN BUS: receive overload, shedding %s -> %s\n",
+            canBusMonitorShedName(m->shedLevel), canBusMonitorShedName(level));
+        m->shedLevel = level;
+    }
+
+    m->windowStartUs = nowUs;
+    m->windowReads = 0;
+    m->windowFullReads = 0;
+    m->windowDrops = 0;
+}
+
+/**
+ * Accounts for one read from the bus socket and updates the shed level.
+ *
+ * @param m the bus monitor
+ * @param count the number of frames read
+ * @param full whether the read filled the whole batch, so more frames
+ *        were likely waiting
+ * @param dropCount the SO_RXQ_OVFL count of the last frame read, 0 if it
+ *        carried none
+ * @param nowUs the time now, from canNowUs()
+ *
+ * @return uint32_t the number of frames the socket dropped since the
+ *         previous read
+ */
+uint32_t canBusMonitorRxRead(canBusMonitor_t *m, int count, int full,
+    uint32_t dropCount, uint64_t nowUs)
+{
+    uint32_t dropped = 0;
+
+    if ((dropCount != 0) && (dropCount != m->rxDropCount)) {
+        /* the kernel counter wraps, so does the difference */
+        dropped = dropCount - m->rxDropCount;
+        m->rxDropCount = dropCount;
+        m->rxKernelDrops += dropped;
+        m->windowDrops += dropped;
+    }
+
+    if (nowUs - m->windowStartUs >= CAN_OVERLOAD_WINDOW_US) {
+        canBusMonitorWindow(m, nowUs);
+    }
+    if (count > 0) {
+        m->windowReads++;
+        m->windowFullReads += full ? 1 : 0;
+    }
+    return dropped;
+}
+
+/**
+ * Logs the bus load and error state.
+ */
+void canBusMonitorLogStats(canBusMonitor_t *m, const char *name)
+{
+    const uint64_t nowUs = canNowUs();
+
+    LogMsg(LOG_NOTICE, "%s load: %.1f%% (1 s), %.1f%% (10 s) at %d bit/s\n",
+        name, canBusMonitorLoad(m, CAN_LOAD_BUCKETS / 10, nowUs),
+        canBusMonitorLoad(m, CAN_LOAD_BUCKETS, nowUs), m->bitrate);
+    LogMsg(LOG_NOTICE, "%s load: rx %llu frames %llu bits, "
+        "tx %llu frames %llu bits\n",
+        name, (unsigned long long)m->rxFrames, (unsigned long long)m->rxBits,
+        (unsigned long long)m->txFrames, (unsigned long long)m->txBits);
+    LogMsg(LOG_NOTICE, "%s state: %s, tx errors %d, rx errors %d, "
+        "error frames %llu, bus-off %llu, restarts %llu\n",
+        name, canStateName(m->state), m->txErrors, m->rxErrors,
+        (unsigned long long)m->errorFrames,
+        (unsigned long long)m->busOffCount, (unsigned long long)m->restarts);
+    LogMsg(LOG_NOTICE, "%s overload: shedding %s, kernel drops %llu, "
+        "shed %llu\n", name, canBusMonitorShedName(m->shedLevel),
+        (unsigned long long)m->rxKernelDrops, (unsigned long long)m->rxShed);
+}
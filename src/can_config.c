@@ -0,0 +1,524 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_agent.h"
+
+/*
+ * The run time configuration: which frames the clients get, how fast,
+ * and the gateway routes.  It is read from a text file, one directive
+ * per line, '#' starts a comment:
+ *
+ *   filter <id>[/<mask>]                   relay only matching frames
+ *   ratelimit <id>[/<mask>] <per second> [<burst>]
+ *   route <src bus> <id>[/<mask>] <dst bus> [id=<new id>] [map=...]
+ *   shed <id>[/<mask>]                     drop first when overloaded
+ *   rcvbuf <bytes>                         CAN socket receive buffer
+ *   rule <name> <bus> <id>[/<mask>] [<condition>...] <action>...
+ *
+ * Without any filter every frame is relayed.  A rate limit caps how many
+ * frames matching it are relayed to the clients per second, all matching
+ * IDs sharing one token bucket.  Routes are described in can_gateway.c.
+ * Frames matching a shed line are neither relayed nor routed while the
+ * agent cannot keep up with a bus, see canBusMonitorRxRead().  Rules
+ * are described in can_local.c.
+ *
+ * A loaded configuration is never changed, apart from the rate limit
+ * token counts which only the main loop touches (the rules keep their
+ * run time state outside it, see can_local.c).  A reload builds a
+ * complete new configuration and publishes it with a single pointer
+ * store; the main loop picks it up on its next pass.  The old one is freed once the
+ * main loop has gone through a quiescent point (the top of its loop,
+ * where it holds no configuration pointer) after the swap, so it never
+ * takes a lock and never sees a half built table.
+ */
+
+#define CAN_RATE_SCALE 1000000ULL   /* token units per frame */
+
+static canConfig_t *currentConfig;
+static unsigned long readerEpoch;
+/* only the loading thread takes and returns configurations */
+static canPool_t canConfigPool;
+
+/**
+ * Parses a hex CAN ID.  More than 3 digits make it an extended ID, like
+ * candump writes them.
+ *
+ * @param text the ID, ended by any non hex character
+ * @param id set to the ID, with CAN_EFF_FLAG for an extended one
+ * @param eff set to 1 for an extended ID, 0 otherwise
+ *
+ * @return int the number of digits parsed, -1 if there are none or the
+ *         value is out of range
+ */
+int canParseId(const char *text, canid_t *id, int *eff)
+{
+    const size_t digits = strspn(text, "0123456789abcdefABCDEF");
+    unsigned long value;
+    size_t i;
+
+    if ((digits == 0) || (digits > 8)) {
+        return -1;
+    }
+
+    value = 0;
+    for (i = 0; i < digits; i++) {
+        const char c = text[i];
+        value = (value << 4) |
+                ((c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+
+    if (digits > 3) {
+        if (value > CAN_EFF_MASK) {
+            return -1;
+        }
+        *id = value | CAN_EFF_FLAG;
+        *eff = 1;
+    } else {
+        if (value > CAN_SFF_MASK) {
+            return -1;
+        }
+        *id = value;
+        *eff = 0;
+    }
+    return (int)digits;
+}
+
+/**
+ * Parses "<id>[/<mask>]".  Without a mask all ID bits must match.
+ *
+ * @param text the ID and mask, ended by a NUL
+ * @param id set to the ID bits selected by the mask, with CAN_EFF_FLAG
+ *           for an extended ID
+ * @param mask set to the mask, limited to the bits of the ID format
+ *
+ * @return int 0 on success, -1 on a syntax error
+ */
+int canParseIdMask(const char *text, canid_t *id, canid_t *mask)
+{
+    int eff;
+    int maskEff;
+    canid_t value;
+    int digits = canParseId(text, id, &eff);
+
+    if (digits < 0) {
+        return -1;
+    }
+
+    *mask = eff ? CAN_EFF_MASK : CAN_SFF_MASK;
+    text += digits;
+    if (*text == '/') {
+        text++;
+        if ((digits = canParseId(text, &value, &maskEff)) < 0) {
+            return -1;
+        }
+        *mask &= value;
+        text += digits;
+    }
+    if (*text != '\0') {
+        return -1;
+    }
+
+    *id &= *mask | CAN_EFF_FLAG;
+    return 0;
+}
+
+static inline int canIdMaskMatch(const canIdMask_t *m, canid_t id)
+{
+    return (id & (m->mask | CAN_EFF_FLAG)) == m->id;
+}
+
+static int canConfigAddFilter(canConfig_t *cfg, char *args)
+{
+    canIdMask_t m;
+    char *save;
+    char *tok = strtok_r(args, " \t\r\n", &save);
+
+    if ((tok == 0) || (strtok_r(0, " \t\r\n", &save) != 0) ||
+        (canParseIdMask(tok, &m.id, &m.mask) < 0)) {
+        return -1;
+    }
+
+    cfg->filterCount++;
+    if (m.id & CAN_EFF_FLAG) {
+        if (cfg->effFilterCount == CAN_CFG_MAX_FILTERS) {
+            return -1;
+        }
+        cfg->effFilters[cfg->effFilterCount++] = m;
+    } else {
+        canid_t id;
+        for (id = 0; id <= CAN_SFF_MASK; id++) {
+            if (canIdMaskMatch(&m, id)) {
+                cfg->sffFilter[id / 32] |= 1U << (id % 32);
+            }
+        }
+    }
+    return 0;
+}
+
+static int canConfigAddShed(canConfig_t *cfg, char *args)
+{
+    canIdMask_t m;
+    char *save;
+    char *tok = strtok_r(args, " \t\r\n", &save);
+
+    if ((tok == 0) || (strtok_r(0, " \t\r\n", &save) != 0) ||
+        (canParseIdMask(tok, &m.id, &m.mask) < 0)) {
+        return -1;
+    }
+
+    if (m.id & CAN_EFF_FLAG) {
+        if (cfg->effShedCount == CAN_CFG_MAX_FILTERS) {
+            return -1;
+        }
+        cfg->effShed[cfg->effShedCount++] = m;
+    } else {
+        canid_t id;
+        for (id = 0; id <= CAN_SFF_MASK; id++) {
+            if (canIdMaskMatch(&m, id)) {
+                cfg->sffShed[id / 32] |= 1U << (id % 32);
+            }
+        }
+    }
+    return 0;
+}
+
+static int canConfigAddRcvBuf(canConfig_t *cfg, char *args)
+{
+    char *end;
+    char *save;
+    char *tok = strtok_r(args, " \t\r\n", &save);
+
+    if ((tok == 0) || (strtok_r(0, " \t\r\n", &save) != 0)) {
+        return -1;
+    }
+    cfg->rcvBuf = strtol(tok, &end, 10);
+    return ((*end == '\0') && (cfg->rcvBuf > 0)) ? 0 : -1;
+}
+
+static int canConfigAddRateLimit(canConfig_t *cfg, char *args)
+{
+    canRateLimit_t *limit;
+    char *end;
+    char *save;
+    char *idTok = strtok_r(args, " \t\r\n", &save);
+    char *rateTok = strtok_r(0, " \t\r\n", &save);
+    char *burstTok = strtok_r(0, " \t\r\n", &save);
+    canid_t id;
+
+    if ((idTok == 0) || (rateTok == 0) || (strtok_r(0, " \t\r\n", &save) != 0) ||
+        (cfg->limitCount == CAN_CFG_MAX_LIMITS)) {
+        return -1;
+    }
+
+    limit = &cfg->limits[cfg->limitCount];
+    memset(limit, 0, sizeof(*limit));
+    if (canParseIdMask(idTok, &limit->match.id, &limit->match.mask) < 0) {
+        return -1;
+    }
+    limit->perSecond = strtoul(rateTok, &end, 10);
+    if ((*end != '\0') || (limit->perSecond == 0)) {
+        return -1;
+    }
+    limit->burst = limit->perSecond;
+    if (burstTok != 0) {
+        limit->burst = strtoul(burstTok, &end, 10);
+        if ((*end != '\0') || (limit->burst == 0)) {
+            return -1;
+        }
+    }
+    limit->tokens = limit->burst * CAN_RATE_SCALE;
+
+    /* standard IDs find their limit through a table, the first one wins */
+    if (!(limit->match.id & CAN_EFF_FLAG)) {
+        for (id = 0; id <= CAN_SFF_MASK; id++) {
+            if ((cfg->sffLimit[id] == 0) && canIdMaskMatch(&limit->match, id)) {
+                cfg->sffLimit[id] = cfg->limitCount + 1;
+            }
+        }
+    }
+
+    cfg->limitCount++;
+    return 0;
+}
+
+/* returns the arguments after keyword if the line starts with it */
+static char *canConfigKeyword(char *line, const char *keyword)
+{
+    const size_t len = strlen(keyword);
+
+    if ((strncmp(line, keyword, len) != 0) ||
+        ((line[len] != ' ') && (line[len] != '\t'))) {
+        return 0;
+    }
+    return line + len;
+}
+
+/**
+ * Carves the configuration pool from the memory budget.
+ *
+ * @return int 0 on success, -1 if the budget is too small
+ */
+int canConfigPoolInit(void)
+{
+    return canPoolInit(&canConfigPool, "config", sizeof(canConfig_t),
+                       CAN_CFG_SLOTS);
+}
+
+/**
+ * Reads the configuration file and the gateway routing table and
+ * builds a new configuration from them.
+ *
+ * @param configPath the configuration file, or 0 for none
+ * @param gatewayPath a separate routing table file, or 0 for none
+ *
+ * @return canConfig_t* the configuration, to be released with
+ *         canConfigFree(), or 0 if a file could not be read or has
+ *         errors (they are logged)
+ */
+canConfig_t *canConfigLoad(const char *configPath, const char *gatewayPath)
+{
+    canConfig_t *cfg;
+    int errors = 0;
+
+    if ((cfg = canPoolGet(&canConfigPool)) == 0) {
+        LogMsg(LOG_ERR, "no free configuration slot\n");
+        return 0;
+    }
+    memset(cfg, 0, sizeof(*cfg));
+
+    if ((gatewayPath != 0) || (configPath != 0)) {
+        if ((cfg->gateway = canGatewayCreate()) == 0) {
+            canPoolPut(&canConfigPool, cfg);
+            return 0;
+        }
+    }
+
+    if (gatewayPath != 0) {
+        const int rv = canGatewayReadFile(cfg->gateway, gatewayPath);
+        errors += (rv < 0) ? 1 : rv;
+    }
+
+    if (configPath != 0) {
+        char line[256];
+        int lineNo = 0;
+        FILE *fp = fopen(configPath, "r");
+
+        if (fp == 0) {
+            LogMsg(LOG_ERR, "%s(): cannot open %s: %s\n", __FUNCTION__,
+                configPath, strerror(errno));
+            errors++;
+        } else {
+            while (fgets(line, sizeof(line), fp) != 0) {
+                char *comment = strchr(line, '#');
+                char *args;
+                char *rest;
+                int rv = 0;
+
+                lineNo++;
+                if (comment != 0) {
+                    *comment = '\0';
+                }
+                args = line + strspn(line, " \t\r\n");
+                if (*args == '\0') {
+                    continue;
+                }
+
+                if ((rest = canConfigKeyword(args, "filter")) != 0) {
+                    rv = canConfigAddFilter(cfg, rest);
+                } else if ((rest = canConfigKeyword(args, "ratelimit")) != 0) {
+                    rv = canConfigAddRateLimit(cfg, rest);
+                } else if ((rest = canConfigKeyword(args, "route")) != 0) {
+                    rv = (canGatewayAddRoute(cfg->gateway, rest) > 0) ? 0 : -1;
+                } else if ((rest = canConfigKeyword(args, "shed")) != 0) {
+                    rv = canConfigAddShed(cfg, rest);
+                } else if ((rest = canConfigKeyword(args, "rcvbuf")) != 0) {
+                    rv = canConfigAddRcvBuf(cfg, rest);
+                } else if ((rest = canConfigKeyword(args, "rule")) != 0) {
+                    if ((cfg->rules == 0) &&
+                        ((cfg->rules = canLocalCreate()) == 0)) {
+                        rv = -1;
+                    } else {
+                        rv = canHandleLocal(cfg->rules, rest);
+                    }
+                } else {
+                    rv = -1;
+                }
+
+                if (rv < 0) {
+                    LogMsg(LOG_ERR, "%s:%d: bad line\n", configPath, lineNo);
+                    errors++;
+                }
+            }
+            fclose(fp);
+        }
+    }
+
+    if (cfg->gateway != 0) {
+        if (cfg->gateway->routeCount == 0) {
+            canGatewayFree(cfg->gateway);
+            cfg->gateway = 0;
+        } else if (canGatewayCompile(cfg->gateway) < 0) {
+            errors++;
+        }
+    }
+
+    if ((cfg->rules != 0) && (canLocalCompile(cfg->rules) < 0)) {
+        errors++;
+    }
+
+    if (errors > 0) {
+        canConfigFree(cfg);
+        return 0;
+    }
+
+    LogMsg(LOG_INFO, "configuration: %d filters, %d rate limits, %d routes, "
+        "%d rules\n", cfg->filterCount, cfg->limitCount,
+        cfg->gateway ? cfg->gateway->routeCount : 0,
+        cfg->rules ? cfg->rules->ruleCount : 0);
+    return cfg;
+}
+
+void canConfigFree(canConfig_t *cfg)
+{
+    if (cfg != 0) {
+        canGatewayFree(cfg->gateway);
+        canLocalFree(cfg->rules);
+        canPoolPut(&canConfigPool, cfg);
+    }
+}
+
+static int canRateLimitTake(canRateLimit_t *limit, uint64_t nowUs)
+{
+    const uint64_t cap = limit->burst * CAN_RATE_SCALE;
+
+    if (limit->lastUs != 0) {
+        limit->tokens += (nowUs - limit->lastUs) * limit->perSecond;
+        if (limit->tokens > cap) {
+            limit->tokens = cap;
+        }
+    }
+    limit->lastUs = nowUs;
+
+    if (limit->tokens < CAN_RATE_SCALE) {
+        limit->dropped++;
+        return 0;
+    }
+    limit->tokens -= CAN_RATE_SCALE;
+    return 1;
+}
+
+/**
+ * Decides whether a received frame is relayed to the clients, applying
+ * the filters and the rate limits.  Only the main loop may call this,
+ * it updates the rate limit buckets.
+ *
+ * @return int 1 to relay the frame, 0 to hold it back
+ */
+int canConfigPassClient(canConfig_t *cfg, const struct can_frame *frame,
+    uint64_t nowUs)
+{
+    const canid_t id = frame->can_id;
+    int i;
+
+    if (!(id & CAN_EFF_FLAG)) {
+        const canid_t sff = id & CAN_SFF_MASK;
+
+        if ((cfg->filterCount > 0) &&
+            !(cfg->sffFilter[sff / 32] & (1U << (sff % 32)))) {
+            return 0;
+        }
+        return (cfg->sffLimit[sff] == 0) ||
+               canRateLimitTake(&cfg->limits[cfg->sffLimit[sff] - 1], nowUs);
+    }
+
+    if (cfg->filterCount > 0) {
+        for (i = 0; i < cfg->effFilterCount; i++) {
+            if (canIdMaskMatch(&cfg->effFilters[i], id)) {
+                break;
+            }
+        }
+        if (i == cfg->effFilterCount) {
+            return 0;
+        }
+    }
+    for (i = 0; i < cfg->limitCount; i++) {
+        if (canIdMaskMatch(&cfg->limits[i].match, id)) {
+            return canRateLimitTake(&cfg->limits[i], nowUs);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Tells whether a frame is one to shed while the agent is overloaded.
+ */
+int canConfigShed(const canConfig_t *cfg, const struct can_frame *frame)
+{
+    const canid_t id = frame->can_id;
+    int i;
+
+    if (!(id & CAN_EFF_FLAG)) {
+        const canid_t sff = id & CAN_SFF_MASK;
+        return (cfg->sffShed[sff / 32] >> (sff % 32)) & 1;
+    }
+    for (i = 0; i < cfg->effShedCount; i++) {
+        if (canIdMaskMatch(&cfg->effShed[i], id)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Logs how many frames each rate limit held back.
+ */
+void canConfigLogStats(const canConfig_t *cfg)
+{
+    int i;
+
+    for (i = 0; i < cfg->limitCount; i++) {
+        const canRateLimit_t *limit = &cfg->limits[i];
+        LogMsg(LOG_NOTICE, "rate limit %x/%x %u/s: %llu frames held back\n",
+            limit->match.id, limit->match.mask, limit->perSecond,
+            (unsigned long long)limit->dropped);
+    }
+    if (cfg->rules != 0) {
+        canLocalLogStats(cfg->rules);
+    }
+}
+
+/**
+ * Returns the published configuration.  The main loop must not keep the
+ * pointer past its next canConfigQuiescent() call.
+ */
+canConfig_t *canConfigGet(void)
+{
+    return __atomic_load_n(&currentConfig, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Makes a configuration the current one.
+ *
+ * @return canConfig_t* the configuration it replaces, which may only be
+ *         freed once canConfigEpoch() has moved on from its value after
+ *         this call
+ */
+canConfig_t *canConfigPublish(canConfig_t *cfg)
+{
+    return __atomic_exchange_n(&currentConfig, cfg, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Called by the main loop where it holds no configuration pointer.
+ */
+void canConfigQuiescent(void)
+{
+    __atomic_add_fetch(&readerEpoch, 1, __ATOMIC_SEQ_CST);
+}
+
+unsigned long canConfigEpoch(void)
+{
+    return __atomic_load_n(&readerEpoch, __ATOMIC_SEQ_CST);
+}
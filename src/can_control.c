@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "can_agent.h"
+
+/*
+ * Configuration reloads run on their own thread so parsing files and
+ * compiling tables never holds up the main loop.  A reload is asked for
+ * with SIGHUP or by sending "reload" to the control socket, a Unix
+ * datagram socket that answers every command with a one line reply.
+ * "stats" asks the main loop to log its statistics.
+ *
+ * The main loop is woken through a pipe: 'r' after a new configuration
+ * is published so it passes a quiescent point soon, 's' to log the
+ * statistics.
+ */
+
+static int controlFd = -1;
+static int hangupPipe[2] = { -1, -1 };
+static int wakePipe[2] = { -1, -1 };
+static const char *reloadConfigPath;
+static const char *reloadGatewayPath;
+static uint32_t openBusMask;
+
+static void canControlWake(char what)
+{
+    if (write(wakePipe[1], &what, 1) < 0) {
+        /* the pipe is full, the main loop is already being woken */
+    }
+}
+
+/**
+ * Builds a new configuration and swaps it in, then frees the old one
+ * once the main loop can no longer be using it.
+ *
+ * @return int 0 on success, -1 if the new configuration was rejected
+ *         (the old one stays in use)
+ */
+static int canControlReload(void)
+{
+    canConfig_t *cfg;
+    canConfig_t *old;
+    unsigned long epoch;
+
+    LogMsg(LOG_NOTICE, "reloading configuration\n");
+
+    cfg = canConfigLoad(reloadConfigPath, reloadGatewayPath);
+    if (cfg == 0) {
+        LogMsg(LOG_ERR, "reload failed, keeping the old configuration\n");
+        return -1;
+    }
+    if ((cfg->gateway != 0) && (cfg->gateway->busMask & ~openBusMask)) {
+        LogMsg(LOG_ERR, "reload routes buses that are not open, "
+            "keeping the old configuration\n");
+        canConfigFree(cfg);
+        return -1;
+    }
+    if ((cfg->rules != 0) && (canLocalCheckBuses(cfg->rules, openBusMask) < 0)) {
+        LogMsg(LOG_ERR, "reload has rules on buses that are not open, "
+            "keeping the old configuration\n");
+        canConfigFree(cfg);
+        return -1;
+    }
+
+    old = canConfigPublish(cfg);
+
+    /* wait for the main loop to pass a quiescent point */
+    epoch = canConfigEpoch();
+    canControlWake('r');
+    while (canConfigEpoch() == epoch) {
+        usleep(1000);
+    }
+    canConfigFree(old);
+
+    LogMsg(LOG_NOTICE, "configuration reloaded\n");
+    return 0;
+}
+
+static void canControlCommand(void)
+{
+    char cmd[64];
+    const char *reply;
+    struct sockaddr_un from;
+    socklen_t fromLen = sizeof(from);
+    const ssize_t len = recvfrom(controlFd, cmd, sizeof(cmd) - 1, 0,
+                                 (struct sockaddr *)&from, &fromLen);
+
+    if (len <= 0) {
+        return;
+    }
+    cmd[len] = '\0';
+    cmd[strcspn(cmd, "\r\n")] = '\0';
+
+    if (strcmp(cmd, "reload") == 0) {
+        reply = (canControlReload() == 0) ? "ok\n" : "error\n";
+    } else if (strcmp(cmd, "stats") == 0) {
+        canControlWake('s');
+        reply = "ok\n";
+    } else {
+        reply = "unknown command\n";
+    }
+
+    if (fromLen > sizeof(sa_family_t)) {
+        sendto(controlFd, reply, strlen(reply), 0, (struct sockaddr *)&from,
+            fromLen);
+    }
+}
+
+static void *canControlThread(void *arg)
+{
+    struct pollfd fds[2];
+
+    (void)arg;
+
+    fds[0].fd = hangupPipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = controlFd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, (controlFd >= 0) ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LogMsg(LOG_ERR, "%s(): poll() failed, errno = %d\n", __FUNCTION__,
+                errno);
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char buff[16];
+            /* several SIGHUPs in a row make one reload */
+            if (read(hangupPipe[0], buff, sizeof(buff)) > 0) {
+                canControlReload();
+            }
+        }
+        if ((controlFd >= 0) && (fds[1].revents & POLLIN)) {
+            canControlCommand();
+        }
+    }
+
+    return 0;
+}
+
+static int canControlCreateSocket(const char *controlPath)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+        LogMsg(LOG_ERR, "control socket() failed, errno = %d\n", errno);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, controlPath, sizeof(addr.sun_path) - 1);
+
+    unlink(controlPath);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LogMsg(LOG_ERR, "control bind() failed, errno = %d\n", errno);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Opens the control socket and starts the reload thread.
+ *
+ * @param controlPath the file system path for the control socket
+ * @param configPath the configuration file to reload, or 0
+ * @param gatewayPath the routing table file to reload, or 0
+ * @param busMask the buses that are open; a reload may only route
+ *        between these and only have rules on these
+ *
+ * @return int the descriptor the main loop watches for wake ups, -1 on
+ *         failure
+ */
+int canControlStart(const char *controlPath, const char *configPath,
+    const char *gatewayPath, uint32_t busMask)
+{
+    pthread_t thread;
+    sigset_t blocked;
+    sigset_t saved;
+    int rv;
+
+    reloadConfigPath = configPath;
+    reloadGatewayPath = gatewayPath;
+    openBusMask = busMask;
+
+    if ((pipe(hangupPipe) < 0) || (pipe(wakePipe) < 0)) {
+        LogMsg(LOG_ERR, "pipe() failed, errno = %d\n", errno);
+        return -1;
+    }
+    fcntl(hangupPipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    /* reloads still work through SIGHUP without the socket */
+    controlFd = canControlCreateSocket(controlPath);
+
+    /* the thread inherits the mask, so the signals go to the main loop */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+    rv = pthread_create(&thread, 0, canControlThread, 0);
+    pthread_sigmask(SIG_SETMASK, &saved, 0);
+    if (rv != 0) {
+        LogMsg(LOG_ERR, "pthread_create() failed\n");
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return wakePipe[0];
+}
+
+/**
+ * Asks for a reload; safe to call from a signal handler.
+ */
+void canControlHangup(void)
+{
+    const int savedErrno = errno;
+
+    if (write(hangupPipe[1], "h", 1) < 0) {
+        /* a reload is already pending */
+    }
+    errno = savedErrno;
+}
+
+/**
+ * Removes the control socket file.
+ */
+void canControlStop(const char *controlPath)
+{
+    if (controlFd >= 0) {
+        unlink(controlPath);
+    }
+}
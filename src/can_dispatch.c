@@ -0,0 +1,244 @@
+#include <string.h>
+
+#include "can_agent.h"
+
+/*
+ * Per bus and ID dispatch, shared by the gateway routes and the rules.
+ * A table is compiled from one key (bus, ID and mask) per route or rule
+ * into a direct 2048 entry table per bus for standard IDs, a hash table
+ * for exact extended IDs and a short list per bus for masked extended
+ * keys.  Each table entry is the start of a chain of key indices ended
+ * by CAN_DISPATCH_NONE, so one frame can be for several of them, and
+ * chains holding the same indices are stored once.  A frame nothing is
+ * about costs one table lookup.
+ *
+ * The chains go in space the owner of the table provides.  The lookups
+ * are inline in can_agent.h, they run for every frame.  The exact ID
+ * hash also serves on its own, see can_transaction.c.
+ */
+
+/* chain contents seen while compiling, to share identical chains */
+#define CAN_DISPATCH_INTERN_SLOTS 4096
+
+static inline int canDispatchIdMatch(const canDispatchKey_t *key, int bus,
+    canid_t id)
+{
+    return (key->bus == bus) && ((id & (key->mask | CAN_EFF_FLAG)) == key->id);
+}
+
+static inline int canDispatchExact(const canDispatchKey_t *key)
+{
+    return (key->id & CAN_EFF_FLAG) && (key->mask == CAN_EFF_MASK);
+}
+
+static uint32_t canDispatchChainHash(const uint16_t *idx, int count)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        h = (h ^ idx[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* the terminator stops the walk, idx never holds it */
+static int canDispatchSameChain(const canDispatch_t *d, int start,
+    const uint16_t *idx, int count)
+{
+    int i;
+
+    for (i = 0; (i < count) && (d->chains[start + i] == idx[i]); i++) {
+    }
+    return (i == count) && (d->chains[start + count] == CAN_DISPATCH_NONE);
+}
+
+/*
+ * Returns the start of a chain holding the indices listed in idx: prev
+ * or any chain built before if it holds exactly the same ones, else a
+ * new one.  interned is a table of CAN_DISPATCH_INTERN_SLOTS chain
+ * starts, CAN_DISPATCH_NONE where free, that remembers the chains built.
+ */
+static int canDispatchAddChain(canDispatch_t *d, const uint16_t *idx,
+    int count, int prev, uint16_t *interned)
+{
+    uint32_t slot;
+    int probes;
+
+    if (count == 0) {
+        return CAN_DISPATCH_NONE;
+    }
+
+    /* neighbouring IDs mostly share theirs */
+    if ((prev != CAN_DISPATCH_NONE) && canDispatchSameChain(d, prev, idx, count)) {
+        return prev;
+    }
+
+    slot = canDispatchChainHash(idx, count) & (CAN_DISPATCH_INTERN_SLOTS - 1);
+    for (probes = 0; probes < CAN_DISPATCH_INTERN_SLOTS; probes++) {
+        if (interned[slot] == CAN_DISPATCH_NONE) {
+            break;
+        }
+        if (canDispatchSameChain(d, interned[slot], idx, count)) {
+            return interned[slot];
+        }
+        slot = (slot + 1) & (CAN_DISPATCH_INTERN_SLOTS - 1);
+    }
+
+    if (d->chainLen + count + 1 > d->chainSize) {
+        LogMsg(LOG_ERR, "dispatch table needs more than %d chain entries\n",
+            d->chainSize);
+        return -1;
+    }
+
+    prev = d->chainLen;
+    memcpy(d->chains + prev, idx, count * sizeof(*idx));
+    d->chains[prev + count] = CAN_DISPATCH_NONE;
+    d->chainLen += count + 1;
+    if (probes < CAN_DISPATCH_INTERN_SLOTS) {
+        interned[slot] = prev;
+    }
+    return prev;
+}
+
+/**
+ * Finds the slot of an ID in an open addressing table of exact IDs.
+ *
+ * @param slots the table, never full, free slots have the id
+ *              CAN_DISPATCH_EMPTY
+ * @param size the number of slots, a power of two
+ * @param bus the interface number
+ * @param id the ID with CAN_EFF_FLAG
+ *
+ * @return canDispatchSlot_t* the slot holding the ID, or the free slot
+ *         it would go in
+ */
+canDispatchSlot_t *canDispatchFind(canDispatchSlot_t *slots, int size,
+    int bus, canid_t id)
+{
+    uint32_t slot = canDispatchHash(bus, id) & (size - 1);
+
+    while ((slots[slot].id != CAN_DISPATCH_EMPTY) &&
+           ((slots[slot].id != id) || (slots[slot].bus != bus))) {
+        slot = (slot + 1) & (size - 1);
+    }
+    return &slots[slot];
+}
+
+/**
+ * Sets up an empty dispatch table.
+ *
+ * @param d the table
+ * @param chains the owner's space for chains
+ * @param chainSize the number of entries in chains
+ */
+void canDispatchInit(canDispatch_t *d, uint16_t *chains, int chainSize)
+{
+    memset(d, 0, sizeof(*d));
+    d->chains = chains;
+    d->chainSize = chainSize;
+}
+
+/**
+ * Compiles a dispatch table from the keys of the routes or rules it
+ * leads to; chain entries are indices into keys.
+ *
+ * @param d a table set up with canDispatchInit()
+ * @param keys the keys
+ * @param count the number of keys, less than CAN_DISPATCH_NONE
+ *
+ * @return int 0 on success, -1 if the chains do not fit
+ */
+int canDispatchCompile(canDispatch_t *d, const canDispatchKey_t *keys,
+    int count)
+{
+    uint16_t idx[CAN_DISPATCH_MAX_KEYS];
+    uint16_t interned[CAN_DISPATCH_INTERN_SLOTS];
+    int bus;
+    int k;
+    int exact = 0;
+
+    memset(interned, 0xFF, sizeof(interned));
+    d->chainLen = 0;
+
+    for (k = 0; k < count; k++) {
+        exact += canDispatchExact(&keys[k]);
+    }
+
+    /* standard IDs: one entry per possible ID */
+    for (bus = 0; bus < CAN_MAX_BUSES; bus++) {
+        int prev = CAN_DISPATCH_NONE;
+        canid_t id;
+
+        for (id = 0; id <= CAN_SFF_MASK; id++) {
+            int n = 0;
+            for (k = 0; k < count; k++) {
+                if (canDispatchIdMatch(&keys[k], bus, id)) {
+                    idx[n++] = k;
+                }
+            }
+            prev = canDispatchAddChain(d, idx, n, prev, interned);
+            if (prev < 0) {
+                return -1;
+            }
+            d->sff[bus][id] = prev;
+        }
+    }
+
+    /* extended IDs: exact ones hashed, masked ones listed per bus */
+    d->effHashSize = 16;
+    while (d->effHashSize < exact * 2) {
+        d->effHashSize *= 2;
+    }
+    for (k = 0; k < d->effHashSize; k++) {
+        d->effHash[k].id = CAN_DISPATCH_EMPTY;
+    }
+
+    for (k = 0; k < count; k++) {
+        const canDispatchKey_t *key = &keys[k];
+        canDispatchSlot_t *slot;
+        int n = 0;
+        int i;
+
+        if (!canDispatchExact(key)) {
+            continue;
+        }
+        slot = canDispatchFind(d->effHash, d->effHashSize, key->bus, key->id);
+        if (slot->id != CAN_DISPATCH_EMPTY) {
+            continue;   /* this ID already has its chain */
+        }
+
+        for (i = k; i < count; i++) {
+            if (canDispatchExact(&keys[i]) &&
+                canDispatchIdMatch(&keys[i], key->bus, key->id)) {
+                idx[n++] = i;
+            }
+        }
+        const int chain = canDispatchAddChain(d, idx, n, CAN_DISPATCH_NONE,
+                                              interned);
+        if (chain < 0) {
+            return -1;
+        }
+        slot->id = key->id;
+        slot->bus = key->bus;
+        slot->chain = chain;
+    }
+
+    for (bus = 0; bus < CAN_MAX_BUSES; bus++) {
+        int n = 0;
+        for (k = 0; k < count; k++) {
+            if ((keys[k].bus == bus) && (keys[k].id & CAN_EFF_FLAG) &&
+                !canDispatchExact(&keys[k])) {
+                idx[n++] = k;
+            }
+        }
+        const int chain = canDispatchAddChain(d, idx, n, CAN_DISPATCH_NONE,
+                                              interned);
+        if (chain < 0) {
+            return -1;
+        }
+        d->effMasked[bus] = chain;
+    }
+
+    return 0;
+}
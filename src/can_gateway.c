@@ -0,0 +1,309 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_agent.h"
+
+/*
+ * The gateway forwards frames between CAN buses inside the agent.  The
+ * routing table is read from a text file (or the route lines of the
+ * configuration file), one route per line:
+ *
+ *   <src bus> <id>[/<mask>] <dst bus> [id=<new id>] [map=<b>,<b>,...]
+ *
+ * Buses are interface numbers (0 for can0).  IDs are hex, written with
+ * 8 digits for extended frames like candump does.  With id= the bits
+ * selected by the mask are replaced by those of the new ID, the others
+ * pass through.  map= builds the outgoing payload from the listed source
+ * byte positions, '_' inserts a zero byte.  Everything after a '#' is a
+ * comment.
+ *
+ * The routes are compiled into dispatch tables by source bus and ID (see
+ * can_dispatch.c), whose chains of route indices let one frame go to
+ * several destinations.
+ */
+
+/* routing tables come from here */
+static canPool_t canGatewayPool;
+
+static int canGatewayParseBus(const char *text)
+{
+    char *end;
+    const long bus = strtol(text, &end, 10);
+
+    if ((end == text) || (*end != '\0') || (bus < 0) || (bus >= CAN_MAX_BUSES)) {
+        return -1;
+    }
+    return (int)bus;
+}
+
+static int canGatewayParseMap(const char *text, canRoute_t *route)
+{
+    route->mapLen = 0;
+
+    while (*text != '\0') {
+        if (route->mapLen == CAN_MAX_DLEN) {
+            return -1;
+        }
+        if (*text == '_') {
+            route->map[route->mapLen++] = -1;
+        } else if ((*text >= '0') && (*text < '0' + CAN_MAX_DLEN)) {
+            route->map[route->mapLen++] = *text - '0';
+        } else {
+            return -1;
+        }
+        text++;
+        if (*text == ',') {
+            text++;
+        } else if (*text != '\0') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parses one route line.
+ *
+ * @return int 1 for a route, 0 for a blank or comment line, -1 on a
+ *         syntax error
+ */
+static int canGatewayParseLine(char *line, canRoute_t *route)
+{
+    char *save;
+    char *tok;
+    char *comment = strchr(line, '#');
+    int eff;
+
+    if (comment != 0) {
+        *comment = '\0';
+    }
+
+    memset(route, 0, sizeof(*route));
+    route->mapLen = -1;
+
+    tok = strtok_r(line, " \t\r\n", &save);
+    if (tok == 0) {
+        return 0;
+    }
+    if ((route->srcBus = canGatewayParseBus(tok)) < 0) {
+        return -1;
+    }
+
+    tok = strtok_r(0, " \t\r\n", &save);
+    if ((tok == 0) || (canParseIdMask(tok, &route->id, &route->mask) < 0)) {
+        return -1;
+    }
+    eff = (route->id & CAN_EFF_FLAG) ? 1 : 0;
+
+    tok = strtok_r(0, " \t\r\n", &save);
+    if ((tok == 0) || ((route->dstBus = canGatewayParseBus(tok)) < 0)) {
+        return -1;
+    }
+
+    while ((tok = strtok_r(0, " \t\r\n", &save)) != 0) {
+        if (strncmp(tok, "id=", 3) == 0) {
+            int newEff;
+            const int digits = canParseId(tok + 3, &route->newId, &newEff);
+            if ((digits < 0) || (tok[3 + digits] != '\0') || (newEff != eff)) {
+                return -1;
+            }
+            route->rewrite = 1;
+        } else if (strncmp(tok, "map=", 4) == 0) {
+            if (canGatewayParseMap(tok + 4, route) < 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    if (route->srcBus == route->dstBus) {
+        return -1;
+    }
+    return 1;
+}
+
+/* route->id carries CAN_EFF_FLAG, so this also tells the frame formats apart */
+static inline int canGatewayIdMatch(const canRoute_t *route, canid_t id)
+{
+    return (id & (route->mask | CAN_EFF_FLAG)) == route->id;
+}
+
+/**
+ * Compiles the routes added to a gateway into its lookup tables.
+ *
+ * @return int 0 on success, -1 if the chains do not fit
+ */
+int canGatewayCompile(canGateway_t *gw)
+{
+    canDispatchKey_t keys[CAN_GW_MAX_ROUTES];
+    int r;
+
+    for (r = 0; r < gw->routeCount; r++) {
+        keys[r].bus = gw->routes[r].srcBus;
+        keys[r].id = gw->routes[r].id;
+        keys[r].mask = gw->routes[r].mask;
+    }
+    return canDispatchCompile(&gw->dispatch, keys, gw->routeCount);
+}
+
+/**
+ * Carves the routing table pool from the memory budget: CAN_GW_SLOTS
+ * tables, the one in use and one being loaded.
+ *
+ * @return int 0 on success, -1 if the budget is too small
+ */
+int canGatewayPoolInit(void)
+{
+    return canPoolInit(&canGatewayPool, "gateway", sizeof(canGateway_t),
+                       CAN_GW_SLOTS);
+}
+
+canGateway_t *canGatewayCreate(void)
+{
+    canGateway_t *gw = canPoolGet(&canGatewayPool);
+
+    if (gw == 0) {
+        LogMsg(LOG_ERR, "no free routing table\n");
+        return 0;
+    }
+    memset(gw, 0, sizeof(*gw));
+    canDispatchInit(&gw->dispatch, gw->chains, CAN_GW_CHAIN_SIZE);
+    return gw;
+}
+
+/**
+ * Adds the route on one line of a routing table to a gateway that has
+ * not been compiled yet.
+ *
+ * @param gw the gateway being built
+ * @param line the route, modified while it is parsed
+ *
+ * @return int 1 for a route, 0 for a blank or comment line, -1 on a
+ *         syntax error or when the table is full
+ */
+int canGatewayAddRoute(canGateway_t *gw, char *line)
+{
+    canRoute_t route;
+    const int rv = canGatewayParseLine(line, &route);
+
+    if (rv <= 0) {
+        return rv;
+    }
+    if (gw->routeCount == CAN_GW_MAX_ROUTES) {
+        return -1;
+    }
+
+    gw->routes[gw->routeCount++] = route;
+    gw->busMask |= (1 << route.srcBus) | (1 << route.dstBus);
+    return 1;
+}
+
+/**
+ * Adds the routes in a routing table file to a gateway that has not
+ * been compiled yet.
+ *
+ * @param gw the gateway being built
+ * @param path the routing table file
+ *
+ * @return int the number of bad lines (they are logged), or -1 if the
+ *         file could not be opened
+ */
+int canGatewayReadFile(canGateway_t *gw, const char *path)
+{
+    char line[256];
+    int lineNo = 0;
+    int errors = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == 0) {
+        LogMsg(LOG_ERR, "%s(): cannot open %s: %s\n", __FUNCTION__, path,
+            strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != 0) {
+        lineNo++;
+        if (canGatewayAddRoute(gw, line) < 0) {
+            LogMsg(LOG_ERR, "%s:%d: bad route\n", path, lineNo);
+            errors++;
+        }
+    }
+    fclose(fp);
+
+    return errors;
+}
+
+void canGatewayFree(canGateway_t *gw)
+{
+    canPoolPut(&canGatewayPool, gw);
+}
+
+static void canGatewayApplyRoute(const canRoute_t *route,
+    const struct can_frame *frame, canGwOut_t *out)
+{
+    int i;
+
+    out->bus = route->dstBus;
+    out->frame = *frame;
+
+    if (route->rewrite) {
+        out->frame.can_id = (frame->can_id & ~route->mask) |
+                            (route->newId & route->mask);
+    }
+    if (route->mapLen >= 0) {
+        for (i = 0; i < route->mapLen; i++) {
+            const int src = route->map[i];
+            out->frame.data[i] = ((src >= 0) && (src < frame->can_dlc)) ?
+                                 frame->data[src] : 0;
+        }
+        for (; i < CAN_MAX_DLEN; i++) {
+            out->frame.data[i] = 0;
+        }
+        out->frame.can_dlc = route->mapLen;
+    }
+}
+
+/**
+ * Looks up the routes for a frame received on a bus and builds the
+ * frames to forward.
+ *
+ * @param gw the compiled gateway
+ * @param bus the interface number the frame came from
+ * @param frame the received frame
+ * @param out array filled in with the destination bus and frame of
+ *            every matching route
+ * @param maxOut the number of entries in out
+ *
+ * @return int the number of entries filled in to out
+ */
+int canGatewayRoute(const canGateway_t *gw, int bus,
+    const struct can_frame *frame, canGwOut_t *out, int maxOut)
+{
+    const canid_t id = frame->can_id;
+    const uint16_t *chain;
+    int count = 0;
+
+    if (id & CAN_ERR_FLAG) {
+        return 0;
+    }
+
+    chain = canDispatchLookup(&gw->dispatch, bus, id);
+    for (; (chain != 0) && (*chain != CAN_DISPATCH_NONE) && (count < maxOut);
+         chain++) {
+        canGatewayApplyRoute(&gw->routes[*chain], frame, &out[count++]);
+    }
+
+    /* masked extended routes are few, try each of them */
+    chain = canDispatchMasked(&gw->dispatch, bus, id);
+    for (; (chain != 0) && (*chain != CAN_DISPATCH_NONE) && (count < maxOut);
+         chain++) {
+        if (canGatewayIdMatch(&gw->routes[*chain], id)) {
+            canGatewayApplyRoute(&gw->routes[*chain], frame, &out[count++]);
+        }
+    }
+
+    return count;
+}
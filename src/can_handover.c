@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "can_agent.h"
+
+/*
+ * Handing a running agent over to a new process without closing a
+ * socket.  Every agent listens on CAN_AGENT_HANDOVER_SOCKET.  A new agent
+ * started with --takeover connects to it and says hello with its state
+ * size and CAN port.  If they match, the running agent, which has just
+ * served its sockets and flushed its queues, sends its descriptors with
+ * SCM_RIGHTS followed by its state.
+ *
+ * The new agent acknowledges with 'k'.  The running agent answers 'y'
+ * once it has read the acknowledgement and exits without touching the
+ * interfaces or socket files.  If the acknowledgement does not come in
+ * time it answers 'n' and carries on.  The new agent only runs on a
+ * 'y'; on anything else it closes what it received.  It waits for the
+ * answer longer than the running agent waits for the acknowledgement,
+ * so the two never both serve the sockets.
+ *
+ * The descriptors stay open all the while, so frames and client data
+ * arriving during the handover wait in the same kernel socket buffers
+ * until the new agent reads them.  The running agent's buses go
+ * unserved while it waits, so its deadlines are short.
+ */
+
+#define CAN_HANDOVER_MAGIC 0x43414E48   /* "CANH" */
+/* how long the running agent waits for each step */
+#define CAN_HANDOVER_STEP_MS 200
+/* how long the new agent waits for the running one */
+#define CAN_HANDOVER_WAIT_MS (5 * CAN_HANDOVER_STEP_MS)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    int canPort;
+} canHandoverHello_t;
+
+static int canHandoverWriteAll(int fd, const void *buff, size_t len)
+{
+    const char *p = buff;
+
+    while (len > 0) {
+        /* a peer that gave up must not take this process with it */
+        const ssize_t cnt = send(fd, p, len, MSG_NOSIGNAL);
+        if (cnt <= 0) {
+            if ((cnt < 0) && (errno == EINTR)) {
+                continue;
+            }
+            return -1;
+        }
+        p += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+static int canHandoverReadAll(int fd, void *buff, size_t len)
+{
+    char *p = buff;
+
+    while (len > 0) {
+        const ssize_t cnt = read(fd, p, len);
+        if (cnt <= 0) {
+            if ((cnt < 0) && (errno == EINTR)) {
+                continue;
+            }
+            return -1;
+        }
+        p += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+static void canHandoverTimeout(int fd, int ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void canHandoverAddress(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+}
+
+/**
+ * Opens the socket a replacement agent connects to.
+ *
+ * @param path the file system path of the socket
+ *
+ * @return int the listening socket, -1 on failure
+ */
+int canHandoverListen(const char *path)
+{
+    struct sockaddr_un addr;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        LogMsg(LOG_ERR, "handover socket() failed, errno = %d\n", errno);
+        return -1;
+    }
+
+    canHandoverAddress(&addr, path);
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(fd, 1) < 0)) {
+        LogMsg(LOG_ERR, "handover socket %s failed, errno = %d\n", path, errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Hands the agent over to a new process that connected to the handover
+ * socket.  The caller has stopped reading from every descriptor.
+ *
+ * @param listenFd the handover socket
+ * @param state the agent's state, its fd fields indexing fds; the magic
+ *        and size are filled in here
+ * @param fds the descriptors to pass
+ * @param fdCount the number of entries in fds
+ *
+ * @return int 0 once the new process has everything, -1 if it did not
+ *         take over and this process carries on
+ */
+int canHandoverSend(int listenFd, canHandover_t *state, const int *fds,
+    int fdCount)
+{
+    canHandoverHello_t hello;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * CAN_HANDOVER_MAX_FDS)];
+    char ack;
+    int status = -1;
+
+    const int fd = accept(listenFd, 0, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    canHandoverTimeout(fd, CAN_HANDOVER_STEP_MS);
+    state->magic = CAN_HANDOVER_MAGIC;
+    state->size = sizeof(*state);
+
+    if (canHandoverReadAll(fd, &hello, sizeof(hello)) < 0) {
+        LogMsg(LOG_ERR, "handover: no hello from the new agent\n");
+        goto e_handover_send;
+    }
+    if ((hello.magic != CAN_HANDOVER_MAGIC) || (hello.size != sizeof(*state)) ||
+        (hello.canPort != state->canPort)) {
+        LogMsg(LOG_ERR, "handover refused: the new agent does not match\n");
+        goto e_handover_send;
+    }
+
+    /* the descriptors go with the count, the state follows */
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &fdCount;
+    iov.iov_len = sizeof(fdCount);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fdCount > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+
+    if ((sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(fdCount)) ||
+        (canHandoverWriteAll(fd, state, sizeof(*state)) < 0)) {
+        LogMsg(LOG_ERR, "handover failed, errno = %d\n", errno);
+        goto e_handover_send;
+    }
+    if ((canHandoverReadAll(fd, &ack, 1) < 0) || (ack != 'k')) {
+        /* tell the new agent to let go, it must not run next to this one */
+        LogMsg(LOG_ERR, "handover not acknowledged, errno = %d\n", errno);
+        canHandoverWriteAll(fd, "n", 1);
+        goto e_handover_send;
+    }
+    if (canHandoverWriteAll(fd, "y", 1) < 0) {
+        LogMsg(LOG_ERR, "handover not confirmed, errno = %d\n", errno);
+        goto e_handover_send;
+    }
+    status = 0;
+
+e_handover_send:
+    close(fd);
+    return status;
+}
+
+/**
+ * Takes over from the agent running on the handover socket.
+ *
+ * @param path the file system path of the handover socket
+ * @param canPort the clients' CAN port, which must be the same
+ * @param state filled in with the running agent's state
+ * @param fds array of CAN_HANDOVER_MAX_FDS entries for the descriptors
+ *
+ * @return int the number of descriptors received, 0 if no agent is
+ *         running, -1 if one is but it could not be taken over
+ */
+int canHandoverReceive(const char *path, int canPort, canHandover_t *state,
+    int *fds)
+{
+    canHandoverHello_t hello;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int) * CAN_HANDOVER_MAX_FDS)];
+    int fdCount = 0;
+    int received = 0;
+    char answer = 0;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    canHandoverAddress(&addr, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return 0;
+    }
+    canHandoverTimeout(fd, CAN_HANDOVER_WAIT_MS);
+
+    hello.magic = CAN_HANDOVER_MAGIC;
+    hello.size = sizeof(*state);
+    hello.canPort = canPort;
+    if (canHandoverWriteAll(fd, &hello, sizeof(hello)) < 0) {
+        goto e_handover_receive;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &fdCount;
+    iov.iov_len = sizeof(fdCount);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(fdCount)) {
+        goto e_handover_receive;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * received);
+        }
+    }
+
+    if ((received != fdCount) || (msg.msg_flags & MSG_CTRUNC) ||
+        (canHandoverReadAll(fd, state, sizeof(*state)) < 0) ||
+        (state->magic != CAN_HANDOVER_MAGIC) || (state->size != sizeof(*state))) {
+        goto e_handover_receive;
+    }
+
+    /* only run once the old agent has said it stops */
+    if ((canHandoverWriteAll(fd, "k", 1) < 0) ||
+        (canHandoverReadAll(fd, &answer, 1) < 0) || (answer != 'y')) {
+        goto e_handover_receive;
+    }
+    close(fd);
+    return fdCount;
+
+e_handover_receive:
+    LogMsg(LOG_ERR, "takeover from the running agent failed\n");
+    while (received > 0) {
+        close(fds[--received]);
+    }
+    close(fd);
+    return -1;
+}
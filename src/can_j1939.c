@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/j1939.h>
+
+#include "can_agent.h"
+
+/*
+ * SAE J1939 through the kernel's CAN_J1939 sockets.  The kernel does the
+ * transport protocols, so a message of up to CAN_J1939_MAX_DATA bytes
+ * goes in and out whole; longer ones are dropped.  The agent is one node
+ * on the clients' bus with its own NAME and claims an address for it.
+ *
+ * candump mode clients use these lines:
+ *
+ *   ?j1939 <pgn>[/<mask>]|* [<sa>|*]   receive the matching messages
+ *   ?j1939 off                         drop every subscription
+ *   J<pgn>,<da>[,<prio>]#<hex>         send a message, da FF to broadcast
+ *
+ * and get "J<pgn>,<sa>,<da>,<prio>#<hex>" for every message received
+ * that one of their subscriptions matches, for example
+ * "J0FEF1,00,FF,6#FFFF0000FFFFFFFF".  All numbers are hex.  Messages are
+ * delivered whether or not the client takes the stream of raw frames.
+ *
+ * Address claiming follows J1939-81: the claim goes out, the address is
+ * used once CAN_J1939_CLAIM_US passed without a contest, and a contest is
+ * won by the lower NAME.  A node that loses and is arbitrary address
+ * capable moves on to a free address in the 128-247 range, otherwise it
+ * announces it cannot claim one and stops sending.
+ */
+
+/* the range an arbitrary address capable node picks from */
+#define CAN_J1939_FIRST_FREE 128
+#define CAN_J1939_LAST_FREE 247
+#define CAN_J1939_ARBITRARY(name) (((name) >> 63) & 1)
+
+static int canJ1939Bind(int fd, int ifindex, uint64_t name, uint8_t addr)
+{
+    struct sockaddr_can sAddr;
+
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.can_family = AF_CAN;
+    sAddr.can_ifindex = ifindex;
+    sAddr.can_addr.j1939.name = name;
+    sAddr.can_addr.j1939.addr = addr;
+    sAddr.can_addr.j1939.pgn = J1939_NO_PGN;
+    return bind(fd, (struct sockaddr *)&sAddr, sizeof(sAddr));
+}
+
+static int canJ1939Socket(int ifindex, uint64_t name, uint8_t addr)
+{
+    const int on = 1;
+    const int fd = socket(PF_CAN, SOCK_DGRAM, CAN_J1939);
+
+    if (fd < 0) {
+        LogMsg(LOG_ERR, "J1939 socket() failed, errno = %d\n", errno);
+        return -1;
+    }
+    if ((setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0) ||
+        (canJ1939Bind(fd, ifindex, name, addr) < 0)) {
+        LogMsg(LOG_ERR, "J1939 socket setup failed, errno = %d\n", errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Claims the address the claim socket is bound to, or announces that no
+ * address could be claimed when it is bound to J1939_IDLE_ADDR.
+ */
+static void canJ1939SendClaim(canJ1939_t *j, uint64_t nowUs)
+{
+    struct sockaddr_can dst;
+    const uint64_t data = htole64(j->name);
+
+    memset(&dst, 0, sizeof(dst));
+    dst.can_family = AF_CAN;
+    dst.can_ifindex = j->ifindex;
+    dst.can_addr.j1939.name = J1939_NO_NAME;
+    dst.can_addr.j1939.addr = J1939_NO_ADDR;
+    dst.can_addr.j1939.pgn = J1939_PGN_ADDRESS_CLAIMED;
+
+    if (sendto(j->claimFd, &data, sizeof(data), MSG_DONTWAIT,
+               (struct sockaddr *)&dst, sizeof(dst)) != sizeof(data)) {
+        LogMsg(LOG_ERR, "J1939 address claim not sent, errno = %d\n", errno);
+    }
+    j->claimUs = nowUs;
+}
+
+/* starts claiming addr, or gives up if it is J1939_IDLE_ADDR */
+static void canJ1939Claim(canJ1939_t *j, uint8_t addr, uint64_t nowUs)
+{
+    if (canJ1939Bind(j->claimFd, j->ifindex, j->name, addr) < 0) {
+        LogMsg(LOG_ERR, "J1939 bind to address %02X failed, errno = %d\n",
+            addr, errno);
+        addr = J1939_IDLE_ADDR;
+        canJ1939Bind(j->claimFd, j->ifindex, j->name, addr);
+    }
+
+    if (addr == J1939_IDLE_ADDR) {
+        LogMsg(LOG_ERR, "J1939 cannot claim an address\n");
+        j->state = CAN_J1939_LOST;
+    } else {
+        LogMsg(LOG_NOTICE, "J1939 claiming address %02X\n", addr);
+        j->addr = addr;
+        j->state = CAN_J1939_CLAIMING;
+    }
+    canJ1939SendClaim(j, nowUs);
+}
+
+/* the next address nobody else claimed, J1939_IDLE_ADDR if there is none */
+static uint8_t canJ1939FreeAddr(const canJ1939_t *j)
+{
+    int i;
+
+    if (!CAN_J1939_ARBITRARY(j->name)) {
+        return J1939_IDLE_ADDR;
+    }
+    /* start after the address just lost */
+    const int range = CAN_J1939_LAST_FREE - CAN_J1939_FIRST_FREE + 1;
+    const int start = ((j->addr >= CAN_J1939_FIRST_FREE) &&
+                       (j->addr <= CAN_J1939_LAST_FREE)) ?
+                      j->addr - CAN_J1939_FIRST_FREE + 1 : 0;
+
+    for (i = 0; i < range; i++) {
+        const int addr = CAN_J1939_FIRST_FREE + (start + i) % range;
+
+        if (!(j->used[addr / 8] & (1 << (addr % 8)))) {
+            return addr;
+        }
+    }
+    return J1939_IDLE_ADDR;
+}
+
+/**
+ * Opens the J1939 sockets on a CAN interface and starts claiming an
+ * address.  Nothing but address claims is sent until the claim holds.
+ *
+ * @param j the J1939 state to set up
+ * @param instance the CAN interface, 0 for can0
+ * @param name the 64 bit J1939 NAME of the agent
+ * @param addr the preferred address, 0 to 0xFD
+ * @param nowUs the current canNowUs() time
+ *
+ * @return int 0 on success, -1 if the sockets could not be opened
+ */
+int canJ1939Init(canJ1939_t *j, int instance, uint64_t name, int addr,
+    uint64_t nowUs)
+{
+    char ifName[IFNAMSIZ];
+    const int on = 1;
+
+    memset(j, 0, sizeof(*j));
+    j->claimFd = -1;
+    j->dataFd = -1;
+    j->sendPrio = -1;
+    j->name = name;
+
+    sprintf(ifName, "can%d", instance);
+    j->ifindex = if_nametoindex(ifName);
+    if (j->ifindex == 0) {
+        LogMsg(LOG_ERR, "J1939: no interface %s\n", ifName);
+        return -1;
+    }
+
+    j->claimFd = canJ1939Socket(j->ifindex, name, J1939_IDLE_ADDR);
+    if (j->claimFd < 0) {
+        return -1;
+    }
+    /* only claims and requests come in on the claim socket */
+    {
+        struct j1939_filter filters[2];
+
+        memset(filters, 0, sizeof(filters));
+        filters[0].pgn = J1939_PGN_ADDRESS_CLAIMED;
+        filters[0].pgn_mask = J1939_PGN_PDU1_MAX;
+        filters[1].pgn = J1939_PGN_REQUEST;
+        filters[1].pgn_mask = J1939_PGN_PDU1_MAX;
+        if (setsockopt(j->claimFd, SOL_CAN_J1939, SO_J1939_FILTER, filters,
+                       sizeof(filters)) < 0) {
+            LogMsg(LOG_ERR, "setsockopt(SO_J1939_FILTER) failed, errno = %d\n",
+                errno);
+        }
+    }
+
+    /* the data socket sends from whatever address the NAME holds */
+    j->dataFd = canJ1939Socket(j->ifindex, name, J1939_IDLE_ADDR);
+    if (j->dataFd < 0) {
+        canJ1939Close(j);
+        return -1;
+    }
+    /* subscriptions may be for messages between other nodes */
+    if (setsockopt(j->dataFd, SOL_CAN_J1939, SO_J1939_PROMISC, &on,
+                   sizeof(on)) < 0) {
+        LogMsg(LOG_ERR, "setsockopt(SO_J1939_PROMISC) failed, errno = %d\n",
+            errno);
+    }
+
+    canJ1939Claim(j, addr, nowUs);
+    return 0;
+}
+
+/**
+ * Closes the J1939 sockets.
+ */
+void canJ1939Close(canJ1939_t *j)
+{
+    if (j->claimFd >= 0) {
+        close(j->claimFd);
+        j->claimFd = -1;
+    }
+    if (j->dataFd >= 0) {
+        close(j->dataFd);
+        j->dataFd = -1;
+    }
+}
+
+/**
+ * Handles an address claim or request for one from another node: a
+ * contested claim is defended or given up, and a request for claims is
+ * answered with ours.
+ *
+ * @param j the J1939 state
+ * @param nowUs the current canNowUs() time
+ */
+void canJ1939ClaimRead(canJ1939_t *j, uint64_t nowUs)
+{
+    struct sockaddr_can src;
+    socklen_t srcLen = sizeof(src);
+    uint8_t data[8];
+
+    const ssize_t len = recvfrom(j->claimFd, data, sizeof(data), MSG_DONTWAIT,
+                                 (struct sockaddr *)&src, &srcLen);
+    if (len < 0) {
+        return;
+    }
+
+    if (src.can_addr.j1939.pgn == J1939_PGN_REQUEST) {
+        /* the requested PGN, little endian */
+        if ((len == 3) && (data[0] == (J1939_PGN_ADDRESS_CLAIMED & 0xFF)) &&
+            (data[1] == ((J1939_PGN_ADDRESS_CLAIMED >> 8) & 0xFF)) &&
+            (data[2] == (J1939_PGN_ADDRESS_CLAIMED >> 16))) {
+            canJ1939SendClaim(j, j->claimUs);
+        }
+        return;
+    }
+
+    if ((src.can_addr.j1939.pgn != J1939_PGN_ADDRESS_CLAIMED) || (len != 8)) {
+        return;
+    }
+
+    uint64_t name;
+    const uint8_t sa = src.can_addr.j1939.addr;
+
+    memcpy(&name, data, sizeof(name));
+    name = le64toh(name);
+
+    if ((name == j->name) || (sa > J1939_MAX_UNICAST_ADDR)) {
+        return;
+    }
+    j->used[sa / 8] |= 1 << (sa % 8);
+
+    if ((sa != j->addr) || (j->state == CAN_J1939_LOST)) {
+        return;
+    }
+
+    j->conflicts++;
+    if (j->name < name) {
+        /* the lower NAME keeps the address, tell the other node */
+        canJ1939SendClaim(j, (j->state == CAN_J1939_CLAIMED) ? j->claimUs : nowUs);
+    } else {
+        LogMsg(LOG_NOTICE, "J1939 address %02X lost to NAME %016llX\n", sa,
+            (unsigned long long)name);
+        canJ1939Claim(j, canJ1939FreeAddr(j), nowUs);
+    }
+}
+
+/**
+ * Takes the address into use once its claim went uncontested long enough.
+ */
+void canJ1939Poll(canJ1939_t *j, uint64_t nowUs)
+{
+    if ((j->state == CAN_J1939_CLAIMING) &&
+        (nowUs >= j->claimUs + CAN_J1939_CLAIM_US)) {
+        LogMsg(LOG_NOTICE, "J1939 address %02X claimed\n", j->addr);
+        j->state = CAN_J1939_CLAIMED;
+    }
+}
+
+/**
+ * Returns when canJ1939Poll() next has work to do, 0 for never.
+ */
+uint64_t canJ1939NextUs(const canJ1939_t *j)
+{
+    return (j->state == CAN_J1939_CLAIMING) ? j->claimUs + CAN_J1939_CLAIM_US : 0;
+}
+
+/**
+ * Reads a J1939 message without waiting.
+ *
+ * @param j the J1939 state
+ * @param msg filled in with the message
+ *
+ * @return int 1 for a message, 0 if none is waiting or one was dropped
+ *         for its size, -1 on an error reading the socket
+ */
+int canJ1939Read(canJ1939_t *j, canJ1939Msg_t *msg)
+{
+    struct sockaddr_can src;
+    struct iovec iov;
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(uint8_t)) * 2 + CMSG_SPACE(sizeof(uint64_t))];
+    ssize_t len;
+
+    iov.iov_base = msg->data;
+    iov.iov_len = sizeof(msg->data);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &src;
+    hdr.msg_namelen = sizeof(src);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    len = recvmsg(j->dataFd, &hdr, MSG_DONTWAIT);
+    if (len < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENETDOWN)) {
+            return 0;
+        }
+        LogMsg(LOG_ERR, "J1939 recvmsg() failed, errno = %d\n", errno);
+        return -1;
+    }
+    if (hdr.msg_flags & MSG_TRUNC) {
+        j->truncated++;
+        return 0;
+    }
+
+    msg->pgn = src.can_addr.j1939.pgn;
+    msg->sa = src.can_addr.j1939.addr;
+    msg->da = J1939_NO_ADDR;
+    msg->prio = 6;
+    msg->len = len;
+
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != 0; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_CAN_J1939) {
+            continue;
+        }
+        if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR) {
+            msg->da = *CMSG_DATA(cmsg);
+        } else if (cmsg->cmsg_type == SCM_J1939_PRIO) {
+            msg->prio = *CMSG_DATA(cmsg);
+        }
+    }
+
+    j->rxMsgs++;
+    return 1;
+}
+
+/**
+ * Tells whether a client subscribed to a message.
+ */
+int canJ1939Wanted(const canJ1939_t *j, int client, const canJ1939Msg_t *msg)
+{
+    int i;
+
+    for (i = 0; i < j->subCount[client]; i++) {
+        const canJ1939Sub_t *sub = &j->subs[client][i];
+
+        if (((msg->pgn & sub->pgnMask) == sub->pgn) &&
+            ((sub->sa < 0) || (sub->sa == msg->sa))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Formats a received message as "J<pgn>,<sa>,<da>,<prio>#<hex>".
+ *
+ * @param msg the message
+ * @param out buffer of at least CAN_J1939_MAX_LINE bytes
+ *
+ * @return int the number of characters written; out is NUL ended
+ */
+int canJ1939Format(const canJ1939Msg_t *msg, char *out)
+{
+    char *p = out + sprintf(out, "J%05X,%02X,%02X,%u#", (unsigned)msg->pgn,
+                            msg->sa, msg->da, msg->prio);
+
+    p = canTextHex(p, msg->data, msg->len);
+    *p++ = '\n';
+    *p = '\0';
+    return p - out;
+}
+
+/**
+ * Handles the arguments of a "?j1939" line from a client.
+ *
+ * @param j the J1939 state
+ * @param client the client slot
+ * @param args what follows "?j1939", modified while it is parsed
+ *
+ * @return int 0 on success, -1 on a syntax error or a full table
+ */
+int canJ1939Command(canJ1939_t *j, int client, char *args)
+{
+    canJ1939Sub_t sub;
+    unsigned long value;    /* checked before it goes in sub */
+    char *save;
+    char *end;
+    char *slash;
+    int i;
+
+    char *pgnTok = strtok_r(args, " \t", &save);
+    char *saTok = strtok_r(0, " \t", &save);
+
+    if ((pgnTok == 0) || (strtok_r(0, " \t", &save) != 0)) {
+        return -1;
+    }
+    if ((strcmp(pgnTok, "off") == 0) && (saTok == 0)) {
+        j->subCount[client] = 0;
+        return 0;
+    }
+
+    sub.pgn = 0;
+    sub.pgnMask = 0;
+    sub.sa = -1;
+    if (strcmp(pgnTok, "*") != 0) {
+        slash = strchr(pgnTok, '/');
+        sub.pgnMask = J1939_PGN_MAX;
+        if (slash != 0) {
+            *slash++ = '\0';
+            value = strtoul(slash, &end, 16);
+            if ((*end != '\0') || (*slash == '\0') || (value > J1939_PGN_MAX)) {
+                return -1;
+            }
+            sub.pgnMask = value;
+        }
+        value = strtoul(pgnTok, &end, 16);
+        if ((*end != '\0') || (*pgnTok == '\0') || (value > J1939_PGN_MAX)) {
+            return -1;
+        }
+        sub.pgn = value & sub.pgnMask;
+    }
+    if ((saTok != 0) && (strcmp(saTok, "*") != 0)) {
+        value = strtoul(saTok, &end, 16);
+        if ((*end != '\0') || (*saTok == '\0') || (value > J1939_NO_ADDR)) {
+            return -1;
+        }
+        sub.sa = value;
+    }
+
+    for (i = 0; i < j->subCount[client]; i++) {
+        if (memcmp(&j->subs[client][i], &sub, sizeof(sub)) == 0) {
+            return 0;
+        }
+    }
+    if (j->subCount[client] == CAN_J1939_MAX_SUBS) {
+        return -1;
+    }
+    j->subs[client][j->subCount[client]++] = sub;
+    return 0;
+}
+
+/**
+ * Sends a "J<pgn>,<da>[,<prio>]#<hex>" line from a client.  The kernel
+ * splits messages longer than 8 bytes with the transport protocol.
+ *
+ * @param j the J1939 state
+ * @param line the line, without its line end
+ * @param len the number of characters in line
+ *
+ * @return int 0 on success, -1 on a syntax error, while no address is
+ *         claimed or if the kernel refused the message
+ */
+int canJ1939Send(canJ1939_t *j, const char *line, size_t len)
+{
+    static uint8_t data[CAN_J1939_MAX_DATA];
+    struct sockaddr_can dst;
+    unsigned long fields[3];
+    const char *p = line + 1;
+    const char *hash = memchr(line, '#', len);
+    char *end;
+    int fieldCount = 0;
+    int count;
+
+    if ((len == 0) || (line[0] != 'J') || (hash == 0)) {
+        return -1;
+    }
+    while (fieldCount < 3) {
+        fields[fieldCount++] = strtoul(p, &end, 16);
+        if ((end == p) || ((*end != ',') && (end != hash))) {
+            return -1;
+        }
+        p = end + 1;
+        if (end == hash) {
+            break;
+        }
+    }
+    if ((p != hash + 1) || (fieldCount < 2) || (fields[0] > J1939_PGN_MAX) ||
+        (fields[1] > J1939_NO_ADDR) || (fields[1] == J1939_IDLE_ADDR) ||
+        ((fieldCount == 3) && (fields[2] > 7))) {
+        return -1;
+    }
+
+    count = canTextUnhex(p, line + len - p, data, sizeof(data));
+    if (count < 0) {
+        return -1;
+    }
+
+    if (j->state != CAN_J1939_CLAIMED) {
+        LogMsg(LOG_ERR, "J1939 message not sent, no address claimed\n");
+        j->txErrors++;
+        return -1;
+    }
+
+    /* the default priority is 6, like the kernel's */
+    {
+        const int prio = (fieldCount == 3) ? (int)fields[2] : 6;
+
+        if ((prio != j->sendPrio) &&
+            (setsockopt(j->dataFd, SOL_CAN_J1939, SO_J1939_SEND_PRIO, &prio,
+                        sizeof(prio)) == 0)) {
+            j->sendPrio = prio;
+        }
+    }
+
+    memset(&dst, 0, sizeof(dst));
+    dst.can_family = AF_CAN;
+    dst.can_ifindex = j->ifindex;
+    dst.can_addr.j1939.name = J1939_NO_NAME;
+    dst.can_addr.j1939.addr = fields[1];
+    dst.can_addr.j1939.pgn = fields[0];
+
+    /* a transport session still running to the same node gives EAGAIN */
+    if (sendto(j->dataFd, data, count, MSG_DONTWAIT, (struct sockaddr *)&dst,
+               sizeof(dst)) != count) {
+        LogMsg(LOG_ERR, "J1939 PGN %05lX to %02lX not sent, errno = %d\n",
+            fields[0], fields[1], errno);
+        j->txErrors++;
+        return -1;
+    }
+    j->txMsgs++;
+    return 0;
+}
+
+/**
+ * Drops the subscriptions of a client that disconnected.
+ */
+void canJ1939ReleaseClient(canJ1939_t *j, int client)
+{
+    j->subCount[client] = 0;
+}
+
+/**
+ * Logs the address claim state and message counters.
+ */
+void canJ1939LogStats(const canJ1939_t *j)
+{
+    static const char *states[] = { "claiming", "claimed", "lost" };
+
+    LogMsg(LOG_NOTICE, "j1939: address %02X %s, received %llu, sent %llu, "
+        "send errors %llu, too long %llu, address conflicts %llu\n",
+        j->addr, states[j->state], (unsigned long long)j->rxMsgs,
+        (unsigned long long)j->txMsgs, (unsigned long long)j->txErrors,
+        (unsigned long long)j->truncated, (unsigned long long)j->conflicts);
+}
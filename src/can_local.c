@@ -1,12 +1,651 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include "can_agent.h"
 
-char *canHandleLocal(char *qmlString)
+/*
+ * Trigger/action rules the agent runs itself on the receive path, so an
+ * interlock does not wait for a round trip through a client.  Rules are
+ * rule lines of the configuration file:
+ *
+ *   rule <name> <bus> <id>[/<mask>] [<condition>...] <action>...
+ *
+ * Conditions, all of which must hold:
+ *
+ *   data=<hex>/<hex mask>      the masked payload bytes, from byte 0
+ *   sig=<start>,<len>[,be][,s]<op><value>
+ *                              a decoded signal compared with ==, !=, <,
+ *                              <=, > or >= to a decimal value
+ *
+ * A signal is <len> bits (1 to 64).  Without be the payload is read
+ * little endian and <start> is the bit number of the signal's lowest bit
+ * (bit 0 is the low bit of byte 0).  With be it is read big endian and
+ * <start> counts from the first bit on the wire (the top bit of byte 0)
+ * to the signal's highest bit.  s makes it signed.  Bytes beyond the
+ * frame's length read as zero.
+ *
+ * Actions:
+ *
+ *   send=<bus>,<id>,<hex>      queue a frame on a bus
+ *   notify                     send "!rule <name> <frame>" to the clients
+ *   capture=<path>             start logging every frame to a file, in
+ *                              candump -l format; a running capture to
+ *                              the same file just goes on
+ *   stop                       stop the capture
+ *   holdoff=<ms>               fire at most once in that time
+ *
+ * The rules are compiled into dispatch tables by bus and ID like the
+ * gateway routes (see can_dispatch.c), so a frame no rule is about costs
+ * one table lookup.
+ *
+ * A rule set is part of the published configuration and never changes
+ * once loaded.  What a rule does at run time, when it last fired and
+ * how often, is kept here instead, by the main loop only.  When a reload
+ * brings a new rule set the state follows each rule by name, so a
+ * holdoff running across the reload still holds and the counts go on; a
+ * new rule starts afresh.
+ */
+
+/* run time state of a rule, main loop only */
+typedef struct {
+    char name[16];
+    uint64_t lastUs;    /* last firing */
+    uint64_t fired;
+} canRuleState_t;
+
+/* rule sets come from here, one per configuration slot */
+static canPool_t canLocalPool;
+/* the capture running, main loop only */
+static int captureFd = -1;
+static char capturePath[CAN_RULE_MAX_PATH];
+static char *captureBuff;           /* CAN_CAPTURE_BUFFER_SIZE, from the arena */
+static size_t captureLen;
+static uint64_t captureDropped;     /* frames the buffer had no room for */
+static int64_t captureOffsetUs;     /* wall clock minus canNowUs() */
+/* state of the rules of the set with serial stateSerial, main loop only */
+static canRuleState_t ruleState[CAN_RULES_MAX];
+static uint32_t stateSerial;
+/* serial of the last rule set compiled, loading thread only */
+static uint32_t lastSerial;
+
+static const char *canOpNames[] = { "==", "!=", "<=", ">=", "<", ">" };
+static const uint8_t canOpValues[] = {
+    CAN_OP_EQ, CAN_OP_NE, CAN_OP_LE, CAN_OP_GE, CAN_OP_LT, CAN_OP_GT
+};
+
+static int canLocalParseBus(const char *text)
+{
+    char *end;
+    const long bus = strtol(text, &end, 10);
+
+    if ((end == text) || (*end != '\0') || (bus < 0) || (bus >= CAN_MAX_BUSES)) {
+        return -1;
+    }
+    return (int)bus;
+}
+
+static int canLocalParseData(const char *text, canRuleCond_t *cond)
+{
+    uint8_t value[CAN_MAX_DLEN] = { 0 };
+    uint8_t mask[CAN_MAX_DLEN] = { 0 };
+    const char *slash = strchr(text, '/');
+    int len;
+
+    if ((slash == 0) ||
+        ((len = canTextUnhex(text, slash - text, value, CAN_MAX_DLEN)) <= 0) ||
+        (canTextUnhex(slash + 1, strlen(slash + 1), mask, CAN_MAX_DLEN) != len)) {
+        return -1;
+    }
+
+    /* compared in the order the payload lies in memory */
+    cond->kind = CAN_COND_DATA;
+    memcpy(&cond->mask, mask, sizeof(cond->mask));
+    memcpy(&cond->value, value, sizeof(cond->value));
+    cond->value &= cond->mask;
+    return 0;
+}
+
+static int canLocalParseSignal(const char *text, canRuleCond_t *cond)
+{
+    char *end;
+    long start;
+    long len;
+    size_t i;
+
+    start = strtol(text, &end, 10);
+    if ((end == text) || (*end != ',')) {
+        return -1;
+    }
+    text = end + 1;
+    len = strtol(text, &end, 10);
+    if ((end == text) || (len < 1) || (len > 64) || (start < 0) ||
+        (start + len > 64)) {
+        return -1;
+    }
+    text = end;
+
+    cond->kind = CAN_COND_SIGNAL;
+    cond->bigEndian = 0;
+    cond->isSigned = 0;
+    if (strncmp(text, ",be", 3) == 0) {
+        cond->bigEndian = 1;
+        text += 3;
+    }
+    if (strncmp(text, ",s", 2) == 0) {
+        cond->isSigned = 1;
+        text += 2;
+    }
+
+    for (i = 0; i < sizeof(canOpValues); i++) {
+        if (strncmp(text, canOpNames[i], strlen(canOpNames[i])) == 0) {
+            break;
+        }
+    }
+    if (i == sizeof(canOpValues)) {
+        return -1;
+    }
+    cond->op = canOpValues[i];
+    text += strlen(canOpNames[i]);
+
+    cond->value = strtoll(text, &end, 10);
+    if ((end == text) || (*end != '\0')) {
+        return -1;
+    }
+
+    cond->mask = (len == 64) ? ~0ULL : (1ULL << len) - 1;
+    cond->shift = cond->bigEndian ? 64 - start - len : start;
+    return 0;
+}
+
+static int canLocalParseSend(const char *text, canRule_t *rule)
+{
+    char bus[4];
+    const char *comma = strchr(text, ',');
+    canid_t id;
+    int eff;
+    int digits;
+    int len;
+
+    if ((comma == 0) || (comma - text >= (int)sizeof(bus))) {
+        return -1;
+    }
+    memcpy(bus, text, comma - text);
+    bus[comma - text] = '\0';
+    if ((rule->sendBus = canLocalParseBus(bus)) < 0) {
+        return -1;
+    }
+
+    text = comma + 1;
+    if (((digits = canParseId(text, &id, &eff)) < 0) || (text[digits] != ',')) {
+        return -1;
+    }
+    text += digits + 1;
+    len = (*text == '\0') ? 0 :
+          canTextUnhex(text, strlen(text), rule->send.data, CAN_MAX_DLEN);
+    if (len < 0) {
+        return -1;
+    }
+    rule->send.can_id = id;
+    rule->send.can_dlc = len;
+    return 0;
+}
+
+/**
+ * Carves the rule set pool and the capture buffer from the memory
+ * budget.
+ *
+ * @return int 0 on success, -1 if the budget is too small
+ */
+int canLocalPoolInit(void)
+{
+    const int rv = canPoolInit(&canLocalPool, "rules", sizeof(canRules_t),
+                               CAN_CFG_SLOTS);
+
+    captureBuff = canArenaAlloc(CAN_CAPTURE_BUFFER_SIZE);
+    if (captureBuff == 0) {
+        LogMsg(LOG_ERR, "memory budget too small for the capture buffer\n");
+        return -1;
+    }
+    return rv;
+}
+
+/**
+ * Takes an empty rule set from the pool.
+ *
+ * @return canRules_t* the rule set, or 0 if every slot is in use
+ */
+canRules_t *canLocalCreate(void)
+{
+    canRules_t *rules = canPoolGet(&canLocalPool);
+
+    if (rules == 0) {
+        LogMsg(LOG_ERR, "no free rule set slot\n");
+        return 0;
+    }
+    memset(rules, 0, sizeof(*rules));
+    canDispatchInit(&rules->dispatch, rules->chains, CAN_RULE_CHAIN_SIZE);
+    return rules;
+}
+
+void canLocalFree(canRules_t *rules)
+{
+    canPoolPut(&canLocalPool, rules);
+}
+
+/**
+ * Adds one rule to a rule set; this is where rules are loaded.
+ *
+ * @param rules the rule set, compiled once all rules are added
+ * @param line the rule after the "rule" keyword; it is modified
+ *
+ * @return int 0 on success, -1 on a syntax error or a full rule set
+ */
+int canHandleLocal(canRules_t *rules, char *line)
+{
+    canRule_t *rule;
+    char *save;
+    char *tok;
+    int actions = 0;
+
+    if (rules->ruleCount == CAN_RULES_MAX) {
+        return -1;
+    }
+    rule = &rules->rules[rules->ruleCount];
+    memset(rule, 0, sizeof(*rule));
+    rule->sendBus = -1;
+
+    tok = strtok_r(line, " \t\r\n", &save);
+    if ((tok == 0) || (strlen(tok) >= sizeof(rule->name))) {
+        return -1;
+    }
+    strcpy(rule->name, tok);
+
+    tok = strtok_r(0, " \t\r\n", &save);
+    if ((tok == 0) || ((rule->bus = canLocalParseBus(tok)) < 0)) {
+        return -1;
+    }
+    tok = strtok_r(0, " \t\r\n", &save);
+    if ((tok == 0) || (canParseIdMask(tok, &rule->id, &rule->mask) < 0)) {
+        return -1;
+    }
+
+    while ((tok = strtok_r(0, " \t\r\n", &save)) != 0) {
+        int rv = 0;
+
+        if ((strncmp(tok, "data=", 5) == 0) || (strncmp(tok, "sig=", 4) == 0)) {
+            canRuleCond_t *cond = &rule->conds[rule->condCount];
+
+            if (rule->condCount == CAN_RULE_MAX_CONDS) {
+                return -1;
+            }
+            rv = (tok[0] == 'd') ? canLocalParseData(tok + 5, cond) :
+                                   canLocalParseSignal(tok + 4, cond);
+            rule->condCount++;
+        } else if (strncmp(tok, "send=", 5) == 0) {
+            rv = canLocalParseSend(tok + 5, rule);
+            actions++;
+        } else if (strcmp(tok, "notify") == 0) {
+            rule->notify = 1;
+            actions++;
+        } else if (strncmp(tok, "capture=", 8) == 0) {
+            if ((tok[8] == '\0') || (strlen(tok + 8) >= sizeof(rule->capturePath))) {
+                return -1;
+            }
+            strcpy(rule->capturePath, tok + 8);
+            rule->capture = CAN_CAPTURE_START;
+            actions++;
+        } else if (strcmp(tok, "stop") == 0) {
+            rule->capture = CAN_CAPTURE_STOP;
+            actions++;
+        } else if (strncmp(tok, "holdoff=", 8) == 0) {
+            char *end;
+            const long ms = strtol(tok + 8, &end, 10);
+            rv = ((end == tok + 8) || (*end != '\0') || (ms < 0)) ? -1 : 0;
+            rule->holdoffUs = (uint64_t)ms * 1000;
+        } else {
+            rv = -1;
+        }
+        if (rv < 0) {
+            return -1;
+        }
+    }
+
+    if (actions == 0) {
+        return -1;
+    }
+    rules->busMask |= 1 << rule->bus;
+    if (rule->sendBus >= 0) {
+        rules->busMask |= 1 << rule->sendBus;
+    }
+    rules->ruleCount++;
+    return 0;
+}
+
+/**
+ * Checks that every bus the rules read or send on is open, logging each
+ * rule that names one that is not.
+ *
+ * @param rules the rule set
+ * @param busMask the buses that are open
+ *
+ * @return int 0 if they all are, -1 otherwise
+ */
+int canLocalCheckBuses(const canRules_t *rules, uint32_t busMask)
+{
+    int rv = 0;
+    int i;
+
+    if ((rules->busMask & ~busMask) == 0) {
+        return 0;
+    }
+    for (i = 0; i < rules->ruleCount; i++) {
+        const canRule_t *rule = &rules->rules[i];
+
+        if (!(busMask & (1 << rule->bus))) {
+            LogMsg(LOG_ERR, "rule %s: bus %d is not open\n", rule->name,
+                rule->bus);
+            rv = -1;
+        }
+        if ((rule->sendBus >= 0) && !(busMask & (1 << rule->sendBus))) {
+            LogMsg(LOG_ERR, "rule %s: sends on bus %d, which is not open\n",
+                rule->name, rule->sendBus);
+            rv = -1;
+        }
+    }
+    return rv;
+}
+
+static inline int canLocalIdMatch(const canRule_t *rule, canid_t id)
+{
+    return (id & (rule->mask | CAN_EFF_FLAG)) == rule->id;
+}
+
+/**
+ * Compiles the rules added to a rule set into its dispatch tables.
+ *
+ * @return int 0 on success, -1 if the chains do not fit
+ */
+int canLocalCompile(canRules_t *rules)
+{
+    canDispatchKey_t keys[CAN_RULES_MAX];
+    int r;
+
+    rules->serial = ++lastSerial;
+    for (r = 0; r < rules->ruleCount; r++) {
+        keys[r].bus = rules->rules[r].bus;
+        keys[r].id = rules->rules[r].id;
+        keys[r].mask = rules->rules[r].mask;
+    }
+    return canDispatchCompile(&rules->dispatch, keys, rules->ruleCount);
+}
+
+static int canLocalCondHolds(const canRuleCond_t *cond, uint64_t payload)
+{
+    uint64_t raw;
+    int64_t value;
+
+    if (cond->kind == CAN_COND_DATA) {
+        return (payload & cond->mask) == (uint64_t)cond->value;
+    }
+
+    raw = cond->bigEndian ? be64toh(payload) : le64toh(payload);
+    raw = (raw >> cond->shift) & cond->mask;
+    value = (int64_t)raw;
+    if (cond->isSigned && (raw & ~(cond->mask >> 1))) {
+        value = (int64_t)(raw | ~cond->mask);
+    }
+
+    switch (cond->op) {
+    case CAN_OP_EQ: return value == cond->value;
+    case CAN_OP_NE: return value != cond->value;
+    case CAN_OP_LT: return value < cond->value;
+    case CAN_OP_LE: return value <= cond->value;
+    case CAN_OP_GT: return value > cond->value;
+    default:        return value >= cond->value;
+    }
+}
+
+/*
+ * Moves the run time state over to a rule set the main loop has not
+ * seen before, matching the rules by name.  Called once per reload.
+ */
+static void canLocalAdopt(const canRules_t *rules)
 {
-    return((char *)0);
+    canRuleState_t state[CAN_RULES_MAX];
+    uint8_t taken[CAN_RULES_MAX] = { 0 };
+    int i;
+    int j;
+
+    if (rules->serial == stateSerial) {
+        return;
+    }
+
+    memset(state, 0, sizeof(state));
+    for (i = 0; i < rules->ruleCount; i++) {
+        const char *name = rules->rules[i].name;
+
+        for (j = 0; j < CAN_RULES_MAX; j++) {
+            if (!taken[j] && (strcmp(ruleState[j].name, name) == 0)) {
+                taken[j] = 1;
+                state[i] = ruleState[j];
+                break;
+            }
+        }
+        strcpy(state[i].name, name);
+    }
+
+    memcpy(ruleState, state, sizeof(ruleState));
+    stateSerial = rules->serial;
+}
+
+static int canLocalFire(const canRule_t *rule, canRuleState_t *state,
+    uint64_t payload, uint64_t nowUs)
+{
+    int i;
+
+    for (i = 0; i < rule->condCount; i++) {
+        if (!canLocalCondHolds(&rule->conds[i], payload)) {
+            return 0;
+        }
+    }
+    if ((state->fired > 0) && (nowUs - state->lastUs < rule->holdoffUs)) {
+        return 0;
+    }
+    state->lastUs = nowUs;
+    state->fired++;
+    return 1;
+}
+
+/**
+ * Runs the rules for a frame received on a bus.  Main loop only, it
+ * keeps the rules' run time state.
+ *
+ * @param rules the compiled rule set
+ * @param bus the interface number the frame came from
+ * @param frame the received frame
+ * @param nowUs the time now, from canNowUs()
+ * @param fired array filled in with the rules whose conditions hold and
+ *              whose actions are to be carried out
+ * @param maxFired the number of entries in fired
+ *
+ * @return int the number of entries filled in to fired
+ */
+int canLocalMatch(const canRules_t *rules, int bus, const struct can_frame *frame,
+    uint64_t nowUs, const canRule_t **fired, int maxFired)
+{
+    const canid_t id = frame->can_id;
+    const uint16_t *chain = canDispatchLookup(&rules->dispatch, bus, id);
+    const uint16_t *masked = canDispatchMasked(&rules->dispatch, bus, id);
+    uint8_t bytes[CAN_MAX_DLEN] = { 0 };
+    uint64_t payload;
+    int count = 0;
+
+    if ((chain == 0) && (masked == 0)) {
+        return 0;
+    }
+    canLocalAdopt(rules);
+
+    memcpy(bytes, frame->data,
+           (frame->can_dlc < CAN_MAX_DLEN) ? frame->can_dlc : CAN_MAX_DLEN);
+    memcpy(&payload, bytes, sizeof(payload));
+
+    for (; (chain != 0) && (*chain != CAN_DISPATCH_NONE) && (count < maxFired);
+         chain++) {
+        const canRule_t *rule = &rules->rules[*chain];
+        if (canLocalFire(rule, &ruleState[*chain], payload, nowUs)) {
+            fired[count++] = rule;
+        }
+    }
+
+    /* masked extended rules are few, try each of them */
+    for (; (masked != 0) && (*masked != CAN_DISPATCH_NONE) && (count < maxFired);
+         masked++) {
+        const canRule_t *rule = &rules->rules[*masked];
+        if (canLocalIdMatch(rule, id) &&
+            canLocalFire(rule, &ruleState[*masked], payload, nowUs)) {
+            fired[count++] = rule;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Formats the line a notify rule sends to the clients, ended by '\n'.
+ *
+ * @param out buffer of at least CAN_RULE_MAX_LINE bytes
+ *
+ * @return int the number of characters written, out is NUL ended
+ */
+int canLocalFormat(const canRule_t *rule, const struct can_frame *frame,
+    char *out)
+{
+    int len = sprintf(out, "!rule %s ", rule->name);
+
+    len += canTextFormat((const struct canfd_frame *)frame, CAN_MTU, out + len);
+    out[len] = '\0';
+    return len;
+}
+
+/**
+ * Carries out the capture action of a rule, if it has one.  A capture to
+ * the file already being written just goes on; one to another file
+ * replaces it.  The file is opened with open(), which takes no memory.
+ */
+void canLocalCapture(const canRule_t *rule, uint64_t nowUs)
+{
+    struct timeval now;
+
+    if ((rule->capture == CAN_CAPTURE_NONE) ||
+        ((rule->capture == CAN_CAPTURE_START) && (captureFd >= 0) &&
+         (strcmp(capturePath, rule->capturePath) == 0))) {
+        return;
+    }
+    canLocalCaptureStop();
+    if (rule->capture == CAN_CAPTURE_STOP) {
+        return;
+    }
+
+    /* page cache writes, the buffer soaks up a slow disk */
+    captureFd = open(rule->capturePath,
+                     O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (captureFd < 0) {
+        LogMsg(LOG_ERR, "rule %s: cannot open %s: %s\n", rule->name,
+            rule->capturePath, strerror(errno));
+        return;
+    }
+    strcpy(capturePath, rule->capturePath);
+    captureLen = 0;
+    captureDropped = 0;
+    gettimeofday(&now, NULL);
+    captureOffsetUs = (int64_t)now.tv_sec * 1000000 + now.tv_usec - (int64_t)nowUs;
+    LogMsg(LOG_NOTICE, "rule %s: capturing to %s\n", rule->name, capturePath);
+}
+
+/**
+ * Adds a received frame to the capture buffer, if a capture is running.
+ * A frame that does not fit is dropped and counted rather than waiting
+ * for the file.
+ *
+ * @param bus the interface number the frame came from
+ * @param frame the frame
+ * @param rxUs when the kernel received it, on the canNowUs() clock
+ */
+void canLocalCaptureFrame(int bus, const struct can_frame *frame,
+    uint64_t rxUs)
+{
+    char *p;
+    int64_t us;
+
+    if (captureFd < 0) {
+        return;
+    }
+    if (CAN_CAPTURE_BUFFER_SIZE - captureLen < CAN_CAPTURE_MAX_LINE) {
+        captureDropped++;
+        return;
+    }
+
+    us = (int64_t)rxUs + captureOffsetUs;
+    p = captureBuff + captureLen;
+    p += sprintf(p, "(%lld.%06lld) can%d ", (long long)(us / 1000000),
+                 (long long)(us % 1000000), bus);
+    p += canTextFormat((const struct canfd_frame *)frame, CAN_MTU, p);
+    captureLen = p - captureBuff;
+}
+
+/**
+ * Writes what the capture buffer holds with at most one write() call.
+ * Called once per pass of the main loop; whatever the file does not take
+ * stays for the next pass.
+ */
+void canLocalCaptureFlush(void)
+{
+    ssize_t cnt;
+
+    if ((captureFd < 0) || (captureLen == 0)) {
+        return;
+    }
+    cnt = write(captureFd, captureBuff, captureLen);
+    if (cnt > 0) {
+        captureLen -= cnt;
+        memmove(captureBuff, captureBuff + cnt, captureLen);
+    } else if ((cnt < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        LogMsg(LOG_ERR, "capture to %s failed: %s\n", capturePath,
+            strerror(errno));
+        canLocalCaptureStop();
+    }
+}
+
+void canLocalCaptureStop(void)
+{
+    if (captureFd >= 0) {
+        /* one last try, what a full disk does not take is lost */
+        if ((captureLen > 0) && (write(captureFd, captureBuff, captureLen) < 0)) {
+            captureDropped++;
+        }
+        close(captureFd);
+        captureFd = -1;
+        captureLen = 0;
+        LogMsg(LOG_NOTICE, "capture to %s stopped, %llu frames dropped\n",
+            capturePath, (unsigned long long)captureDropped);
+    }
+}
+
+/**
+ * Logs how often each rule fired.  Main loop only.
+ */
+void canLocalLogStats(const canRules_t *rules)
+{
+    int i;
+
+    canLocalAdopt(rules);
+    for (i = 0; i < rules->ruleCount; i++) {
+        LogMsg(LOG_NOTICE, "rule %s: fired %llu times\n", ruleState[i].name,
+            (unsigned long long)ruleState[i].fired);
+    }
 }
@@ -0,0 +1,205 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "can_agent.h"
+
+/*
+ * One arena is taken at startup, the size of the memory budget (-m), and
+ * touched and locked right away so its pages are resident before the
+ * first frame.  Everything the agent works with comes out of it, each
+ * table sized from its compile time limit: the client slots with their
+ * buffers (CAN_MAX_CLIENTS), the transmit queues (CAN_TX_QUEUE_DEPTH per
+ * bus), the transactions (CAN_TXN_MAX), the J1939 node, the receive and
+ * send batches, and the pools of objects that come and go (interfaces,
+ * configurations, routing tables with CAN_GW_CHAIN_SIZE chain entries,
+ * rule sets) plus the capture buffer.  Getting and putting a pool block
+ * is a free list operation and never reaches the C library.
+ *
+ * Every table is carved at startup, before the first frame.  If they do
+ * not all fit the agent says how big a budget they need and does not
+ * start; nothing takes whatever happens to be left over.  What stays
+ * outside the arena is small bookkeeping, the handover message, which
+ * is only touched when a new agent takes over, and these paths off the
+ * frame path that go through the C library:
+ *   - popen() in execute_cmd_ex(), for the commands run at startup and
+ *     shutdown
+ *   - fopen() in canConfigLoad() and canGatewayReadFile(), on every
+ *     reload, in the control thread
+ *   - the syslog and log file writes of LogMsg()
+ *
+ * A pool is used from one thread only.  The pools keep how many blocks
+ * were ever in use at once so the budget can be sized from real loads.
+ */
+
+#define CAN_POOL_ALIGN 16
+
+static char *arena;
+static size_t arenaSize;
+static size_t arenaUsed;
+static size_t arenaShort;   /* asked for beyond the budget */
+static canPool_t *pools[CAN_POOL_MAX];
+static int poolCount;
+
+static size_t canPoolRound(size_t size)
+{
+    return (size + CAN_POOL_ALIGN - 1) & ~(size_t)(CAN_POOL_ALIGN - 1);
+}
+
+/**
+ * Takes the whole memory budget in one allocation.  Called once, before
+ * any pool is set up.
+ *
+ * @param budget the memory budget in bytes
+ *
+ * @return int 0 on success, -1 if the memory is not there
+ */
+int canArenaInit(size_t budget)
+{
+    arenaSize = canPoolRound(budget);
+    arena = aligned_alloc(CAN_POOL_ALIGN, arenaSize);
+    if (arena == 0) {
+        LogMsg(LOG_ERR, "cannot allocate a memory budget of %zu bytes\n",
+            arenaSize);
+        return -1;
+    }
+
+    /* fault every page in now rather than on the frame path */
+    memset(arena, 0, arenaSize);
+    if (mlock(arena, arenaSize) < 0) {
+        LogMsg(LOG_INFO, "mlock() of the memory budget failed, errno = %d\n",
+            errno);
+    }
+    arenaUsed = 0;
+    return 0;
+}
+
+/**
+ * Carves memory for the rest of the run out of the arena.  What does not
+ * fit is added up for canArenaCheck().
+ *
+ * @return void* the memory, or 0 if the budget is used up
+ */
+void *canArenaAlloc(size_t size)
+{
+    void *p;
+
+    size = canPoolRound(size);
+    if ((arena == 0) || (size > arenaSize - arenaUsed)) {
+        arenaShort += size;
+        return 0;
+    }
+    p = arena + arenaUsed;
+    arenaUsed += size;
+    return p;
+}
+
+/**
+ * Tells whether everything carved so far fit in the budget.  Called
+ * once every table is carved, so a budget that is too small is reported
+ * with the size all of them need.
+ *
+ * @return int 0 if everything fit, -1 if not
+ */
+int canArenaCheck(void)
+{
+    if (arenaShort == 0) {
+        return 0;
+    }
+    LogMsg(LOG_ERR, "memory budget of %zu KiB too small, the tables need "
+        "%zu KiB\n", arenaSize / 1024, (arenaUsed + arenaShort + 1023) / 1024);
+    return -1;
+}
+
+/**
+ * Carves a pool of equal blocks from the arena.
+ *
+ * @param pool the pool to set up; it stays registered for the stats
+ * @param name what the stats call it
+ * @param blockSize the size of one block
+ * @param count the number of blocks
+ *
+ * @return int 0 on success, -1 if the budget is too small
+ */
+int canPoolInit(canPool_t *pool, const char *name, size_t blockSize, int count)
+{
+    char *blocks;
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->blockSize = canPoolRound((blockSize < sizeof(void *)) ?
+                                   sizeof(void *) : blockSize);
+    pool->count = count;
+
+    blocks = canArenaAlloc(pool->blockSize * count);
+    if (blocks == 0) {
+        LogMsg(LOG_ERR, "memory budget too small for the %s pool\n", name);
+        pool->count = 0;
+        return -1;
+    }
+
+    /* the free list runs through the blocks themselves */
+    for (i = count - 1; i >= 0; i--) {
+        void *block = blocks + i * pool->blockSize;
+        *(void **)block = pool->freeList;
+        pool->freeList = block;
+    }
+
+    if (poolCount < CAN_POOL_MAX) {
+        pools[poolCount++] = pool;
+    }
+    return 0;
+}
+
+/**
+ * Takes a block from a pool.
+ *
+ * @return void* the block, not cleared, or 0 if every block is in use
+ */
+void *canPoolGet(canPool_t *pool)
+{
+    void *block = pool->freeList;
+
+    if (block == 0) {
+        pool->failures++;
+        return 0;
+    }
+    pool->freeList = *(void **)block;
+    if (++pool->used > pool->highWater) {
+        pool->highWater = pool->used;
+    }
+    return block;
+}
+
+/**
+ * Gives a block back to the pool it came from.
+ */
+void canPoolPut(canPool_t *pool, void *block)
+{
+    if (block != 0) {
+        *(void **)block = pool->freeList;
+        pool->freeList = block;
+        pool->used--;
+    }
+}
+
+/**
+ * Logs the use of the memory budget and of every pool.
+ */
+void canMemoryLogStats(void)
+{
+    int i;
+
+    LogMsg(LOG_NOTICE, "memory: %zu of %zu bytes carved\n", arenaUsed,
+        arenaSize);
+    for (i = 0; i < poolCount; i++) {
+        const canPool_t *pool = pools[i];
+
+        LogMsg(LOG_NOTICE, "pool %s: %d of %d blocks of %zu bytes in use, "
+            "high water %d, exhausted %llu times\n", pool->name, pool->used,
+            pool->count, pool->blockSize, pool->highWater,
+            (unsigned long long)pool->failures);
+    }
+}
@@ -8,13 +8,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <linux/can.h>
+#include <linux/can/raw.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 #include "can_agent.h"
 
 #define MAXPENDING 1
+/*
+ * Frames queued in the driver are charged to the socket's send buffer,
+ * so keeping it small makes the socket stop polling writable while the
+ * controller is busy instead of failing writes with ENOBUFS.
+ */
+#define CAN_SOCKET_SNDBUF 4096
 
 static void canDieWithError(char *errorMessage)
 {
@@ -57,6 +66,51 @@ static int canCreateServerSocket(int instance)
         canDieWithError("Error: CAN bind() failed.");
     }
 
+    /* loop our own frames back so the tx queue sees them complete */
+    const int recvOwn = 1;
+    rv = setsockopt(sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &recvOwn,
+                    sizeof(recvOwn));
+    if (rv < 0)
+    {
+        canDieWithError("Error: setsockopt(CAN_RAW_RECV_OWN_MSGS) failed.");
+    }
+
+    /* error frames drive the bus state monitor */
+    const can_err_mask_t errMask = CAN_ERR_MASK;
+    rv = setsockopt(sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errMask,
+                    sizeof(errMask));
+    if (rv < 0)
+    {
+        canDieWithError("Error: setsockopt(CAN_RAW_ERR_FILTER) failed.");
+    }
+
+    /* receive timestamps measure the gateway forwarding latency */
+    const int timestamp = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &timestamp, sizeof(timestamp)) < 0)
+    {
+        LogMsg(LOG_ERR, "setsockopt(SO_TIMESTAMP) failed, errno = %d\n", errno);
+    }
+
+    /* every frame carries how many the socket buffer had to drop */
+    const int rxqOvfl = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &rxqOvfl, sizeof(rxqOvfl)) < 0)
+    {
+        LogMsg(LOG_ERR, "setsockopt(SO_RXQ_OVFL) failed, errno = %d\n", errno);
+    }
+
+    const int sndBuf = CAN_SOCKET_SNDBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf)) < 0)
+    {
+        LogMsg(LOG_ERR, "setsockopt(SO_SNDBUF) failed, errno = %d\n", errno);
+    }
+
+    /* the tx queue handles a full controller, never block on it */
+    rv = fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    if (rv < 0)
+    {
+        canDieWithError("Error: fcntl(O_NONBLOCK) failed.");
+    }
+
     LogMsg(LOG_INFO, "Handling CAN Bus client\n");
 
     return sock;
@@ -69,73 +123,236 @@ int canServerSocketInit(int instance)
     return listenFd;
 }
 
+/**
+ * Sets the receive buffer of a CAN socket, which decides how long a
+ * burst the socket rides out while the agent is busy.  SO_RCVBUFFORCE
+ * goes past net.core.rmem_max when the agent has CAP_NET_ADMIN.
+ *
+ * @param socketFd the file descriptor of the CAN raw socket
+ * @param bytes the buffer size asked for
+ */
+void canServerSocketSetRcvBuf(int socketFd, int bytes)
+{
+    int size = 0;
+    socklen_t len = sizeof(size);
+
+    if ((setsockopt(socketFd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0) &&
+        (setsockopt(socketFd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0))
+    {
+        LogMsg(LOG_ERR, "setsockopt(SO_RCVBUF) failed, errno = %d\n", errno);
+        return;
+    }
+
+    /* the kernel doubles the size for its bookkeeping and caps it */
+    getsockopt(socketFd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+    LogMsg(LOG_INFO, "CAN socket receive buffer %d bytes (asked for %d)\n",
+        size, bytes);
+}
+
 
 /**
- * Reads a single message from the socket connected to the 
- * tcp/ip server port. If no message is ready to be received, the call
- * will block until one is available. 
- * 
- * @param socketFd the file descriptor of for the already open 
- *                 socket connecting to the tio-agent
- * @param msgBuff address of a contiguous array into which the 
- *                message will be written upon receipt from the
- *                tio-agent
- * @param bufferSize the number of bytes in msgBuff
- * 
- * @return int 0 if no message to return (handled here), -1 if 
- *         recv() returned an error code (close connection) or
- *         >0 to indicate msgBuff has that many characters
- *         filled in
+ * Reads the frames waiting on the CAN bus socket, as many as fit, with a
+ * single recvmmsg() call.
+ *
+ * @param socketFd the file descriptor of the CAN raw socket
+ * @param frames array for the frames received
+ * @param infos filled in for every frame with whether it is the loopback
+ *              copy of one this agent sent, when the kernel received it
+ *              and the socket's drop count at the time
+ * @param maxFrames the number of entries in frames and infos, at most
+ *                  CAN_RX_BATCH_SIZE
+ *
+ * @return int 0 if no frame was ready or the interface is down (it is
+ *         being restarted), -1 if recvmmsg() returned an error code (close
+ *         connection) or >0 for the number of frames filled in
  */
-int canServerSocketRead(int socketFd, char *msgBuff)
+int canServerSocketReadBatch(int socketFd, struct can_frame *frames,
+    canRxInfo_t *infos, int maxFrames)
 {
     int cnt;
     int i;
-    struct can_frame frame;
-    memset(&frame, 0, sizeof(frame));
-    cnt = read(socketFd, &frame, sizeof(frame));
+    struct mmsghdr msgs[CAN_RX_BATCH_SIZE];
+    struct iovec iovs[CAN_RX_BATCH_SIZE];
+    char control[CAN_RX_BATCH_SIZE][CMSG_SPACE(sizeof(struct timeval)) +
+                                    CMSG_SPACE(sizeof(uint32_t))];
+    struct cmsghdr *cmsg;
+    struct timeval now;
+    uint64_t nowUs;
+
+    if (maxFrames > CAN_RX_BATCH_SIZE) {
+        maxFrames = CAN_RX_BATCH_SIZE;
+    }
+
+    memset(msgs, 0, sizeof(msgs[0]) * maxFrames);
+    for (i = 0; i < maxFrames; i++) {
+        iovs[i].iov_base = &frames[i];
+        iovs[i].iov_len = sizeof(frames[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    cnt = recvmmsg(socketFd, msgs, maxFrames, MSG_DONTWAIT, NULL);
 
     if (cnt < 0)
     {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENETDOWN))
+        {
+            return 0;
+        }
         LogMsg(LOG_INFO, "%s(): recv() failed, client closed\n", __FUNCTION__);
         close(socketFd);
         return -1;
     }
-    else
+
+    nowUs = canNowUs();
+    gettimeofday(&now, NULL);
+
+    for (i = 0; i < cnt; i++)
     {
-        strncpy(msgBuff, (char *)frame.data, 8);
-        cnt = frame.can_dlc;
-        msgBuff[cnt] = '\0';
-        LogMsg(LOG_INFO, "%s: buff = %s", __FUNCTION__, msgBuff);
-        return cnt;
+        struct msghdr *msg = &msgs[i].msg_hdr;
+
+        infos[i].ownMsg = (msg->msg_flags & MSG_CONFIRM) ? 1 : 0;
+        infos[i].rxUs = nowUs;
+        infos[i].dropCount = 0;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+            if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMP))
+            {
+                /* the stamp is wall clock time, move it to the monotonic clock */
+                struct timeval stamp;
+                int64_t ageUs;
+
+                memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                ageUs = (int64_t)(now.tv_sec - stamp.tv_sec) * 1000000 +
+                        (now.tv_usec - stamp.tv_usec);
+                if ((ageUs > 0) && ((uint64_t)ageUs < nowUs))
+                {
+                    infos[i].rxUs -= ageUs;
+                }
+            }
+            else if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL))
+            {
+                /* only there once the socket has dropped something */
+                memcpy(&infos[i].dropCount, CMSG_DATA(cmsg), sizeof(uint32_t));
+            }
+        }
     }
 
+    return cnt;
 }
 
 
-void canServerSocketWrite(int socketFd, const char *buff)
+/**
+ * Formats a received frame the way it is relayed to the tio-agent:
+ * the payload bytes as a string.
+ *
+ * @param frame the frame received from the CAN bus
+ * @param msgBuff buffer of at least CAN_MAX_DLEN + 1 bytes for the
+ *                message
+ *
+ * @return int the number of characters in msgBuff
+ */
+int canServerSocketFormat(const struct can_frame *frame, char *msgBuff)
 {
-    int cnt = strlen(buff);
-    if (cnt > 8)
-        cnt = 8;
-    int i = 0;
-    struct can_frame frame;
+    const int cnt = (frame->can_dlc > CAN_MAX_DLEN) ?
+                    CAN_MAX_DLEN : frame->can_dlc;
 
-    memset(&frame, 0, sizeof(frame));
+    strncpy(msgBuff, (const char *)frame->data, cnt);
+    msgBuff[cnt] = '\0';
+    LogMsg(LOG_INFO, "%s: buff = %s\n", __FUNCTION__, msgBuff);
+    return cnt;
+}
+
+
+/**
+ * Converts one message received from the tio-agent into CAN frames.
+ * The message bytes are carried as frame payload with ID 0; a message
+ * longer than one frame is split over as many frames as it needs
+ * rather than being truncated.
+ *
+ * @param msg the message bytes
+ * @param len the number of bytes in msg
+ * @param frames array into which the frames are written
+ * @param maxFrames the number of entries in frames
+ *
+ * @return int the number of frames filled in
+ */
+int canServerSocketParse(const char *msg, size_t len,
+    struct can_frame *frames, int maxFrames)
+{
+    int count = 0;
 
-    frame.can_id = 0;
-    strncpy((char *)frame.data, buff, cnt);
-    frame.can_dlc = cnt;
+    while ((len > 0) && (count < maxFrames)) {
+        struct can_frame *frame = &frames[count++];
+        const size_t cnt = (len > CAN_MAX_DLEN) ? CAN_MAX_DLEN : len;
 
-    if (write(socketFd, &frame, sizeof(frame)) < 0) {
-        LogMsg(LOG_ERR, "CAN BUS: write() failed, %d\n",
-            socketFd);
-        perror("what's messed up?");
+        memset(frame, 0, sizeof(*frame));
+        frame->can_id = 0;
+        memcpy(frame->data, msg, cnt);
+        frame->can_dlc = cnt;
+
+        msg += cnt;
+        len -= cnt;
     }
-    else
-    {
-        LogMsg(LOG_INFO, "%s: sent = %s", __FUNCTION__, frame.data);
+
+    if (len > 0) {
+        LogMsg(LOG_ERR, "%s(): %d bytes did not fit in %d frames\n",
+            __FUNCTION__, (int)len, maxFrames);
+    }
+
+    return count;
+}
+
+
+/**
+ * Transmits a batch of frames on the CAN bus with a single sendmmsg()
+ * call.  A full controller queue (ENOBUFS/EAGAIN) is left for the
+ * caller to retry.
+ *
+ * @param socketFd the CAN raw socket
+ * @param frames the frames to send, in order
+ * @param count the number of entries in frames
+ *
+ * @return int the number of frames handed to the controller, or -1 if
+ *         none could be sent (errno is set)
+ */
+int canServerSocketWriteBatch(int socketFd, const struct can_frame *frames,
+    int count)
+{
+    struct mmsghdr msgs[CAN_TX_BATCH_SIZE];
+    struct iovec iovs[CAN_TX_BATCH_SIZE];
+    int i;
+    int sent;
+
+    if (count > CAN_TX_BATCH_SIZE) {
+        count = CAN_TX_BATCH_SIZE;
+    }
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = (void *)&frames[i];
+        iovs[i].iov_len = sizeof(frames[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    sent = sendmmsg(socketFd, msgs, count, 0);
+    if (sent < 0) {
+        if ((errno != ENOBUFS) && (errno != EAGAIN) && (errno != ENETDOWN)) {
+            const int err = errno;
+            LogMsg(LOG_ERR, "CAN BUS: sendmmsg() failed, %d: %s\n",
+                socketFd, strerror(err));
+            errno = err;
+        }
+    } else {
+        LogMsg(LOG_INFO, "%s: sent %d of %d frames\n", __FUNCTION__, sent,
+            count);
     }
+
+    return sent;
 }
 
 
@@ -0,0 +1,311 @@
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "can_agent.h"
+
+/*
+ * The candump/cansend text format, one frame per line:
+ *
+ *   123#DEADBEEF          standard ID, up to 8 data bytes
+ *   12345678#11.22.33     extended ID, '.' between bytes is allowed
+ *   123#R  123#R4         remote request, optionally with its length
+ *   123##1DEADBEEF...     CAN FD, the digit after "##" holds the flags
+ *
+ * Standard IDs are always written with 3 hex digits and extended ones
+ * with 8, which is how the two are told apart.  Output uses upper case
+ * hex without separators, like candump.
+ *
+ * Hex is converted through tables: two digits per byte on output, a
+ * digit value per character on input.  Payloads are encoded 8 bytes at
+ * a time with SSE2 or NEON where the compiler targets them.
+ */
+
+static const char canHexDigits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+#define CAN_HEX_ROW(h) \
+    { h, '0' }, { h, '1' }, { h, '2' }, { h, '3' }, \
+    { h, '4' }, { h, '5' }, { h, '6' }, { h, '7' }, \
+    { h, '8' }, { h, '9' }, { h, 'A' }, { h, 'B' }, \
+    { h, 'C' }, { h, 'D' }, { h, 'E' }, { h, 'F' }
+
+/* the two digits of every byte value */
+static const char canHexPairs[256][2] = {
+    CAN_HEX_ROW('0'), CAN_HEX_ROW('1'), CAN_HEX_ROW('2'), CAN_HEX_ROW('3'),
+    CAN_HEX_ROW('4'), CAN_HEX_ROW('5'), CAN_HEX_ROW('6'), CAN_HEX_ROW('7'),
+    CAN_HEX_ROW('8'), CAN_HEX_ROW('9'), CAN_HEX_ROW('A'), CAN_HEX_ROW('B'),
+    CAN_HEX_ROW('C'), CAN_HEX_ROW('D'), CAN_HEX_ROW('E'), CAN_HEX_ROW('F')
+};
+
+#define CAN_NOT_HEX_ROW \
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+
+/* the value of every hex digit, -1 for anything else, 16 per row */
+static const int8_t canHexValues[256] = {
+    CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,  /* '0' */
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,  /* '@' */
+    CAN_NOT_HEX_ROW,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,  /* '`' */
+    CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW,
+    CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW, CAN_NOT_HEX_ROW,
+    CAN_NOT_HEX_ROW
+};
+
+/* payload lengths a CAN FD frame can have, by DLC */
+static const uint8_t canFdLengths[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+/**
+ * Writes bytes as upper case hex, two digits each, without a NUL.
+ *
+ * @return char* the end of the output
+ */
+char *canTextHex(char *out, const uint8_t *data, int len)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i low4 = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('A' - '0' - 10);
+
+    for (; i + 8 <= len; i += 8) {
+        const __m128i bytes = _mm_loadl_epi64((const __m128i *)(data + i));
+        const __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), low4);
+        const __m128i lo = _mm_and_si128(bytes, low4);
+        /* high nibble first for every byte */
+        const __m128i nibbles = _mm_unpacklo_epi8(hi, lo);
+        const __m128i over9 = _mm_cmpgt_epi8(nibbles, nine);
+        const __m128i digits = _mm_add_epi8(_mm_add_epi8(nibbles, zero),
+                                            _mm_and_si128(over9, letters));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), digits);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x8x2_t table;
+
+    table.val[0] = vld1_u8((const uint8_t *)canHexDigits);
+    table.val[1] = vld1_u8((const uint8_t *)canHexDigits + 8);
+    for (; i + 8 <= len; i += 8) {
+        const uint8x8_t bytes = vld1_u8(data + i);
+        /* high nibble first for every byte */
+        const uint8x8x2_t nibbles = vzip_u8(vshr_n_u8(bytes, 4),
+                                            vand_u8(bytes, vdup_n_u8(0x0F)));
+        vst1_u8((uint8_t *)out + 2 * i, vtbl2_u8(table, nibbles.val[0]));
+        vst1_u8((uint8_t *)out + 2 * i + 8, vtbl2_u8(table, nibbles.val[1]));
+    }
+#endif
+
+    for (; i < len; i++) {
+        memcpy(out + 2 * i, canHexPairs[data[i]], 2);
+    }
+    return out + 2 * len;
+}
+
+/**
+ * Reads hex digit pairs, optionally with '.' between bytes.
+ *
+ * @param text the digits
+ * @param len the number of characters in text
+ * @param data array for the bytes
+ * @param maxLen the number of entries in data
+ *
+ * @return int the number of bytes, -1 on a bad digit, an odd count or
+ *         more than maxLen bytes
+ */
+int canTextUnhex(const char *text, size_t len, uint8_t *data, int maxLen)
+{
+    const uint8_t *p = (const uint8_t *)text;
+    const uint8_t *end = p + len;
+    int count = 0;
+
+    while (p < end) {
+        int hi;
+        int lo;
+
+        if ((*p == '.') && (count > 0)) {
+            p++;
+            continue;
+        }
+        if ((p + 1 >= end) || (count == maxLen)) {
+            return -1;
+        }
+        hi = canHexValues[p[0]];
+        lo = canHexValues[p[1]];
+        if ((hi | lo) < 0) {
+            return -1;
+        }
+        data[count++] = (hi << 4) | lo;
+        p += 2;
+    }
+    return count;
+}
+
+/**
+ * Formats one frame as a candump line, ended by '\n' (no NUL).
+ *
+ * @param frame the frame; a struct can_frame may be passed in with mtu
+ *        CAN_MTU as the two share their layout
+ * @param mtu CAN_MTU for a classic frame, CANFD_MTU for a CAN FD one
+ * @param out buffer of at least CAN_TEXT_MAX_LINE bytes
+ *
+ * @return int the number of characters written
+ */
+int canTextFormat(const struct canfd_frame *frame, int mtu, char *out)
+{
+    const canid_t id = frame->can_id;
+    char *p = out;
+    int len = frame->len;
+
+    if (id & (CAN_EFF_FLAG | CAN_ERR_FLAG)) {
+        const canid_t bits = (id & CAN_ERR_FLAG) ?
+                             (id & (CAN_ERR_MASK | CAN_ERR_FLAG)) :
+                             (id & CAN_EFF_MASK);
+        memcpy(p, canHexPairs[bits >> 24], 2);
+        memcpy(p + 2, canHexPairs[(bits >> 16) & 0xFF], 2);
+        memcpy(p + 4, canHexPairs[(bits >> 8) & 0xFF], 2);
+        memcpy(p + 6, canHexPairs[bits & 0xFF], 2);
+        p += 8;
+    } else {
+        p[0] = canHexDigits[(id >> 8) & 0x07];
+        memcpy(p + 1, canHexPairs[id & 0xFF], 2);
+        p += 3;
+    }
+    *p++ = '#';
+
+    if (mtu == CANFD_MTU) {
+        *p++ = '#';
+        *p++ = canHexDigits[frame->flags & 0x0F];
+        if (len > CANFD_MAX_DLEN) {
+            len = CANFD_MAX_DLEN;
+        }
+    } else {
+        if (len > CAN_MAX_DLEN) {
+            len = CAN_MAX_DLEN;
+        }
+        if (id & CAN_RTR_FLAG) {
+            *p++ = 'R';
+            if (len > 0) {
+                *p++ = canHexDigits[len];
+            }
+            len = 0;
+        }
+    }
+
+    p = canTextHex(p, frame->data, len);
+    *p++ = '\n';
+    return p - out;
+}
+
+/**
+ * Formats a batch of received frames into one contiguous buffer of
+ * candump lines so it can go to a client with a single write.
+ *
+ * @param frames the frames
+ * @param count the number of entries in frames
+ * @param out buffer of at least count * CAN_TEXT_MAX_LINE + 1 bytes
+ *
+ * @return size_t the number of characters written; out is NUL ended
+ */
+size_t canTextFormatBatch(const struct can_frame *frames, int count, char *out)
+{
+    char *p = out;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        p += canTextFormat((const struct canfd_frame *)&frames[i], CAN_MTU, p);
+    }
+    *p = '\0';
+    return p - out;
+}
+
+/**
+ * Parses one candump line (without its line end) into a frame.
+ *
+ * @param text the line
+ * @param len the number of characters in text
+ * @param frame set to the frame; a classic frame fills the struct
+ *        can_frame sized start of it
+ *
+ * @return int CAN_MTU for a classic frame, CANFD_MTU for a CAN FD one,
+ *         or 0 if the line is not a valid frame
+ */
+int canTextParse(const char *text, size_t len, struct canfd_frame *frame)
+{
+    const uint8_t *p = (const uint8_t *)text;
+    const uint8_t *end = p + len;
+    int maxLen = CAN_MAX_DLEN;
+    int mtu = CAN_MTU;
+    canid_t id = 0;
+    int digits = 0;
+    int count;
+
+    memset(frame, 0, sizeof(*frame));
+
+    while ((p < end) && (canHexValues[*p] >= 0) && (digits < 8)) {
+        id = (id << 4) | canHexValues[*p++];
+        digits++;
+    }
+    if ((p == end) || (*p++ != '#')) {
+        return 0;
+    }
+    if (digits == 3) {
+        if (id > CAN_SFF_MASK) {
+            return 0;
+        }
+    } else if (digits == 8) {
+        /* error frames keep their flag bits, like cansend */
+        if (!(id & CAN_ERR_FLAG)) {
+            id |= CAN_EFF_FLAG;
+        }
+    } else {
+        return 0;
+    }
+    frame->can_id = id;
+
+    if ((p < end) && (*p == '#')) {
+        p++;
+        if ((p == end) || (canHexValues[*p] < 0)) {
+            return 0;
+        }
+        frame->flags = canHexValues[*p++];
+        maxLen = CANFD_MAX_DLEN;
+        mtu = CANFD_MTU;
+    } else if ((p < end) && ((*p == 'R') || (*p == 'r'))) {
+        p++;
+        frame->can_id |= CAN_RTR_FLAG;
+        if (p < end) {
+            if ((p + 1 != end) || (canHexValues[*p] < 0) ||
+                (canHexValues[*p] > CAN_MAX_DLEN)) {
+                return 0;
+            }
+            frame->len = canHexValues[*p];
+        }
+        return CAN_MTU;
+    }
+
+    count = canTextUnhex((const char *)p, end - p, frame->data, maxLen);
+    if (count < 0) {
+        return 0;
+    }
+
+    if (mtu == CANFD_MTU) {
+        /* round up to a length the bus can carry, padded with zeros */
+        int dlc = 0;
+        while (canFdLengths[dlc] < count) {
+            dlc++;
+        }
+        count = canFdLengths[dlc];
+    }
+    frame->len = count;
+    return mtu;
+}
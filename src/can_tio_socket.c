@@ -13,6 +13,10 @@
 
 #define MAXPENDING 1
 
+/* clients dropped while writing to them, main loop only */
+static uint64_t clientsGone;
+static uint64_t clientsSlow;
+
 static void canDieWithError(char *errorMessage)
 {
     LogMsg(LOG_ERR, "Exiting: %s\n", errorMessage);
@@ -121,51 +125,224 @@ int canTioSocketInit(int *addressFamily,
 
 
 /**
- * Reads a single message from the socket connected to the 
- * tio-agent. If no message is ready to be received, the call 
- * will block until one is available. 
- * 
- * @param socketFd the file descriptor of for the already open 
- *                 socket connecting to the tio-agent
- * @param msgBuff address of a contiguous array into which the 
- *                message will be written upon receipt from the
- *                tio-agent
- * @param bufferSize the number of bytes in msgBuff
- * 
- * @return int 0 if no message to return (handled here), -1 if 
- *         recv() returned an error code (close connection) or
- *         >0 to indicate msgBuff has that many characters
- *         filled in
+ * Resets the stream parser state for a newly accepted client.
+ *
+ * @param client the parser state to initialise
+ * @param fd the connected socket, or -1 for an unused slot
+ */
+void canTioClientInit(canTioClient_t *client, int fd)
+{
+    client->fd = fd;
+    client->rxLen = 0;
+    client->rxStart = 0;
+    client->discarding = 0;
+    client->relay = 1;
+    client->txLen = 0;
+    client->failed = 0;
+}
+
+
+/**
+ * Closes a client's connection and frees its slot.
+ *
+ * @param client the client, its slot is left unused
  */
-int canTioSocketRead(int socketFd, char *msgBuff, size_t bufferSize)
+void canTioClientClose(canTioClient_t *client)
+{
+    close(client->fd);
+    canTioClientInit(client, -1);
+}
+
+
+/**
+ * Reads whatever is available from the socket connected to the
+ * tio-agent and splits it into messages.  Messages are terminated by
+ * a newline (an optional carriage return before it is stripped) or a
+ * NUL.  A message that arrives split across several reads is held in
+ * the client's receive buffer until its terminator shows up, and
+ * several messages arriving in one read are all returned.
+ *
+ * The messages are parsed in place: each entry in msgs points into
+ * the client's receive buffer with its terminator replaced by a NUL,
+ * and stays valid until the next call for the same client.  A message
+ * too long for the receive buffer is dropped up to its terminator.
+ *
+ * @param client the per-client parser state, including the socket
+ * @param msgs array to be filled in with the messages received
+ * @param maxMsgs the number of entries in msgs
+ *
+ * @return int -1 if recv() returned an error code or the client
+ *         closed (the client is marked failed), otherwise the number
+ *         of messages filled in, which may be 0 for a partial message
+ */
+int canTioSocketRead(canTioClient_t *client, canTioMsg_t *msgs, int maxMsgs)
 {
     int cnt;
+    int msgCount = 0;
+    size_t i;
+    size_t msgStart;
+
+    /* drop the messages handed out by the previous call */
+    if (client->rxStart > 0) {
+        client->rxLen -= client->rxStart;
+        memmove(client->rxBuff, client->rxBuff + client->rxStart,
+            client->rxLen);
+        client->rxStart = 0;
+    }
 
-    if ((cnt = recv(socketFd, msgBuff, bufferSize, 0)) <= 0) {
+    cnt = recv(client->fd, client->rxBuff + client->rxLen,
+        sizeof(client->rxBuff) - client->rxLen, 0);
+    if (cnt <= 0) {
         LogMsg(LOG_INFO, "%s(): recv() failed, client closed\n", __FUNCTION__);
-        close(socketFd);
+        client->failed = 1;
         return -1;
-    } else {
-        msgBuff[cnt] = 0;
-        LogMsg(LOG_INFO, "%s: buff = %s", __FUNCTION__, msgBuff);
-        return cnt;
     }
+
+    /*
+     * rescan from the start: a previous call that ran out of room in msgs
+     * may have left complete messages behind the partial one
+     */
+    client->rxLen += cnt;
+    msgStart = 0;
+
+    for (i = 0; (i < client->rxLen) && (msgCount < maxMsgs); i++) {
+        char *msg = client->rxBuff + msgStart;
+        size_t len = i - msgStart;
+
+        if ((client->rxBuff[i] != '\n') && (client->rxBuff[i] != '\0')) {
+            continue;
+        }
+
+        client->rxBuff[i] = '\0';
+        msgStart = i + 1;
+
+        if (client->discarding) {
+            /* tail of an oversized message */
+            client->discarding = 0;
+            continue;
+        }
+
+        if ((len > 0) && (msg[len - 1] == '\r')) {
+            msg[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        msgs[msgCount].data = msg;
+        msgs[msgCount].len = len;
+        msgCount++;
+        LogMsg(LOG_INFO, "%s: buff = %s\n", __FUNCTION__, msg);
+    }
+    client->rxStart = msgStart;
+
+    if ((client->rxStart == 0) && (client->rxLen == sizeof(client->rxBuff))) {
+        /* no terminator in a full buffer, give up on this message */
+        if (!client->discarding) {
+            LogMsg(LOG_ERR, "%s(): message longer than %d bytes dropped\n",
+                __FUNCTION__, (int)sizeof(client->rxBuff));
+        }
+        client->discarding = 1;
+        client->rxLen = 0;
+    }
+
+    return msgCount;
+}
+
+
+/**
+ * Sends text to a client without ever waiting for it.  What the socket
+ * does not take is kept in the client's transmit buffer, behind which
+ * later text queues up in order, and goes out from canTioSocketFlush()
+ * once the socket is writable.  A client that has gone away, or has
+ * fallen so far behind that its buffer overflows, is marked failed for
+ * the main loop to drop.
+ *
+ * @param client the client
+ * @param buff NUL ended text, at most CAN_TIO_TX_BUFFER_SIZE characters
+ *
+ * @return int 0 on success, -1 if the client failed
+ */
+int canTioSocketWrite(canTioClient_t *client, const char *buff)
+{
+    const size_t len = strlen(buff);
+    ssize_t cnt = 0;
+
+    if (client->failed) {
+        return -1;
+    }
+
+    if (client->txLen == 0) {
+        cnt = send(client->fd, buff, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (cnt < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                LogMsg(LOG_INFO, "%s(): send() failed, errno = %d, client "
+                    "dropped\n", __FUNCTION__, errno);
+                clientsGone++;
+                client->failed = 1;
+                return -1;
+            }
+            cnt = 0;
+        }
+    }
+
+    if (len - cnt > sizeof(client->txBuff) - client->txLen) {
+        LogMsg(LOG_ERR, "%s(): client %zu bytes behind, dropped\n",
+            __FUNCTION__, client->txLen + len - cnt);
+        clientsSlow++;
+        client->failed = 1;
+        return -1;
+    }
+    memcpy(client->txBuff + client->txLen, buff + cnt, len - cnt);
+    client->txLen += len - cnt;
+    return 0;
 }
 
 
-void canTioSocketWrite(int socketFd, const char *buff)
+/**
+ * Sends as much of a client's transmit buffer as the socket takes.
+ * Called when select() finds the socket writable.
+ *
+ * @param client the client
+ *
+ * @return int 0 on success, -1 if the client failed
+ */
+int canTioSocketFlush(canTioClient_t *client)
 {
-    int cnt = strlen(buff);
+    ssize_t cnt;
 
-    if (send(socketFd, buff, cnt, 0) != cnt) {
-        LogMsg(LOG_ERR, "socket_send_to_client(): send() failed, %d\n",
-            socketFd);
-        perror("what's messed up?");
+    if (client->failed) {
+        return -1;
+    }
+    if (client->txLen == 0) {
+        return 0;
     }
-    else
-    {
-        LogMsg(LOG_INFO, "%s: buff = %s", __FUNCTION__, buff);
+
+    cnt = send(client->fd, client->txBuff, client->txLen,
+        MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (cnt < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return 0;
+        }
+        LogMsg(LOG_INFO, "%s(): send() failed, errno = %d, client dropped\n",
+            __FUNCTION__, errno);
+        clientsGone++;
+        client->failed = 1;
+        return -1;
     }
+
+    client->txLen -= cnt;
+    memmove(client->txBuff, client->txBuff + cnt, client->txLen);
+    return 0;
 }
 
 
+/**
+ * Logs how many clients were dropped while writing to them.
+ */
+void canTioSocketLogStats(void)
+{
+    LogMsg(LOG_NOTICE, "clients: %llu dropped for falling behind, %llu gone "
+        "while written to\n", (unsigned long long)clientsSlow,
+        (unsigned long long)clientsGone);
+}
@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_agent.h"
+
+/*
+ * Request/response transactions let a client send a request frame and
+ * get back only the frames that answer it instead of filtering the
+ * whole bus stream itself.  In candump text mode a client writes
+ *
+ *   ?<tag> <frame> <id>[/<mask>] <timeout ms> [<max responses>]
+ *
+ * for example "?7 7DF#0201050000000000 7E8/7F8 50 8".  The frame is
+ * queued like any other and every frame received with a matching ID is
+ * returned as "=<tag> <frame>".  The transaction ends with "=<tag> done"
+ * once the maximum number of responses arrived, or "=<tag> timeout"
+ * when the timeout runs out first (any number of responses may have
+ * come by then).  Without a maximum it always runs to the timeout.
+ * A request that cannot be parsed or queued gets "=<tag> error".
+ *
+ * Transactions in flight sit in a timer wheel of CAN_TXN_WHEEL_SLOTS
+ * slots of one CAN_TXN_TICK_US tick each, in the slot of their expiry
+ * tick modulo the wheel size.  Starting, answering and ending one is
+ * constant time; expiring walks only the slots of the ticks that passed.
+ * Timeouts longer than one turn of the wheel stay in their slot until
+ * the turn their expiry tick comes up.  The tick to wake up for is
+ * kept, and only looked for again in the wheel once it has passed or
+ * the transaction it was for has ended.
+ *
+ * Transactions are also listed by response ID, so a received frame only
+ * meets the ones it can answer: those waiting for one exact ID hang off
+ * an open addressing table of IDs hashed like the gateway's (see
+ * can_dispatch.c), the few with a mask sit in one list tried in turn.
+ */
+
+static inline int canTxnExact(const canTxn_t *txn)
+{
+    return txn->match.mask ==
+           ((txn->match.id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+}
+
+static canDispatchSlot_t *canTxnIndexFind(canTxnTable_t *t, canid_t id)
+{
+    return canDispatchFind(t->index, CAN_TXN_INDEX_SLOTS, 0, id);
+}
+
+/* empties a slot of the index, moving up the IDs that probed past it */
+static void canTxnIndexRemove(canTxnTable_t *t, canDispatchSlot_t *slot)
+{
+    uint32_t hole = slot - t->index;
+    uint32_t i = hole;
+
+    while (1) {
+        uint32_t home;
+
+        i = (i + 1) & (CAN_TXN_INDEX_SLOTS - 1);
+        if (t->index[i].id == CAN_DISPATCH_EMPTY) {
+            break;
+        }
+        home = canDispatchHash(0, t->index[i].id) & (CAN_TXN_INDEX_SLOTS - 1);
+        if (((i - home) & (CAN_TXN_INDEX_SLOTS - 1)) >=
+            ((i - hole) & (CAN_TXN_INDEX_SLOTS - 1))) {
+            t->index[hole] = t->index[i];
+            hole = i;
+        }
+    }
+    t->index[hole].id = CAN_DISPATCH_EMPTY;
+}
+
+static void canTxnIdLink(canTxnTable_t *t, int i)
+{
+    canTxn_t *txn = &t->txns[i];
+    int16_t head = t->masked;
+    canDispatchSlot_t *slot = 0;
+
+    if (canTxnExact(txn)) {
+        slot = canTxnIndexFind(t, txn->match.id);
+        head = (slot->id != CAN_DISPATCH_EMPTY) ? slot->chain : CAN_TXN_NONE;
+    }
+
+    txn->idPrev = CAN_TXN_NONE;
+    txn->idNext = head;
+    if (head != CAN_TXN_NONE) {
+        t->txns[head].idPrev = i;
+    }
+
+    if (slot == 0) {
+        t->masked = i;
+    } else {
+        slot->id = txn->match.id;
+        slot->bus = 0;
+        slot->chain = i;
+    }
+}
+
+static void canTxnIdUnlink(canTxnTable_t *t, int i)
+{
+    canTxn_t *txn = &t->txns[i];
+
+    if (txn->idNext != CAN_TXN_NONE) {
+        t->txns[txn->idNext].idPrev = txn->idPrev;
+    }
+    if (txn->idPrev != CAN_TXN_NONE) {
+        t->txns[txn->idPrev].idNext = txn->idNext;
+    } else if (!canTxnExact(txn)) {
+        t->masked = txn->idNext;
+    } else {
+        canDispatchSlot_t *slot = canTxnIndexFind(t, txn->match.id);
+
+        if (txn->idNext != CAN_TXN_NONE) {
+            slot->chain = txn->idNext;
+        } else {
+            canTxnIndexRemove(t, slot);
+        }
+    }
+}
+
+static uint64_t canTxnTick(uint64_t nowUs)
+{
+    return nowUs / CAN_TXN_TICK_US;
+}
+
+static void canTxnLink(canTxnTable_t *t, int i)
+{
+    canTxn_t *txn = &t->txns[i];
+    int16_t *head = &t->wheel[txn->expiryTick % CAN_TXN_WHEEL_SLOTS];
+
+    txn->prev = CAN_TXN_NONE;
+    txn->next = *head;
+    if (*head != CAN_TXN_NONE) {
+        t->txns[*head].prev = i;
+    }
+    *head = i;
+}
+
+static void canTxnUnlink(canTxnTable_t *t, int i)
+{
+    canTxn_t *txn = &t->txns[i];
+
+    if (txn->prev != CAN_TXN_NONE) {
+        t->txns[txn->prev].next = txn->next;
+    } else {
+        t->wheel[txn->expiryTick % CAN_TXN_WHEEL_SLOTS] = txn->next;
+    }
+    if (txn->next != CAN_TXN_NONE) {
+        t->txns[txn->next].prev = txn->prev;
+    }
+}
+
+/* takes a transaction out of the wheel and returns its slot */
+static void canTxnEnd(canTxnTable_t *t, int i)
+{
+    canTxnUnlink(t, i);
+    canTxnIdUnlink(t, i);
+    if (t->txns[i].expiryTick == t->nextTick) {
+        t->nextTick = 0;
+    }
+    t->txns[i].client = -1;
+    t->txns[i].next = t->freeList;
+    t->freeList = i;
+    t->active--;
+}
+
+/**
+ * Prepares an empty transaction table.
+ */
+void canTxnInit(canTxnTable_t *t, uint64_t nowUs)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < CAN_TXN_WHEEL_SLOTS; i++) {
+        t->wheel[i] = CAN_TXN_NONE;
+    }
+    for (i = 0; i < CAN_TXN_INDEX_SLOTS; i++) {
+        t->index[i].id = CAN_DISPATCH_EMPTY;
+    }
+    t->masked = CAN_TXN_NONE;
+    for (i = 0; i < CAN_TXN_MAX; i++) {
+        t->txns[i].client = -1;
+        t->txns[i].next = (i + 1 < CAN_TXN_MAX) ? i + 1 : CAN_TXN_NONE;
+    }
+    t->freeList = 0;
+    t->tick = canTxnTick(nowUs);
+}
+
+/**
+ * Parses a transaction line, "?<tag> <frame> <id>[/<mask>] <timeout ms>
+ * [<max responses>]" with the frame in candump format.
+ *
+ * @param line the line, modified while it is parsed
+ * @param req filled in with the request
+ *
+ * @return int 0 on success, -1 on a syntax error; the tag is filled in
+ *         as soon as it could be read so the error can be reported
+ */
+int canTxnParse(char *line, canTxnRequest_t *req)
+{
+    struct canfd_frame frame;
+    char *save;
+    char *end;
+    char *tagTok;
+    char *frameTok;
+    char *matchTok;
+    char *timeoutTok;
+    char *maxTok;
+
+    memset(req, 0, sizeof(*req));
+    if (*line++ != '?') {
+        return -1;
+    }
+
+    tagTok = strtok_r(line, " \t", &save);
+    frameTok = strtok_r(0, " \t", &save);
+    matchTok = strtok_r(0, " \t", &save);
+    timeoutTok = strtok_r(0, " \t", &save);
+    maxTok = strtok_r(0, " \t", &save);
+
+    if (tagTok == 0) {
+        return -1;
+    }
+    req->tag = strtoul(tagTok, &end, 10);
+    if ((*end != '\0') || (frameTok == 0) || (matchTok == 0) ||
+        (timeoutTok == 0) || (strtok_r(0, " \t", &save) != 0)) {
+        return -1;
+    }
+
+    if (canTextParse(frameTok, strlen(frameTok), &frame) != CAN_MTU) {
+        return -1;
+    }
+    memcpy(&req->frame, &frame, sizeof(req->frame));
+
+    if (canParseIdMask(matchTok, &req->match.id, &req->match.mask) < 0) {
+        return -1;
+    }
+
+    req->timeoutMs = strtoul(timeoutTok, &end, 10);
+    if ((*end != '\0') || (req->timeoutMs == 0)) {
+        return -1;
+    }
+
+    if (maxTok != 0) {
+        req->maxResponses = strtol(maxTok, &end, 10);
+        if ((*end != '\0') || (req->maxResponses < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Starts waiting for the responses to a request.  The caller checks
+ * there is room (active below CAN_TXN_MAX) and queues the request frame.
+ *
+ * @param t the transaction table
+ * @param client the client slot the replies go to
+ * @param req the parsed request
+ * @param nowUs the current canNowUs() time
+ */
+void canTxnStart(canTxnTable_t *t, int client, const canTxnRequest_t *req,
+    uint64_t nowUs)
+{
+    const int i = t->freeList;
+    canTxn_t *txn = &t->txns[i];
+    /* round up so the timeout is never cut short by the tick */
+    const uint64_t ticks = ((uint64_t)req->timeoutMs * 1000 +
+                            CAN_TXN_TICK_US - 1) / CAN_TXN_TICK_US;
+
+    t->freeList = txn->next;
+    txn->client = client;
+    txn->tag = req->tag;
+    txn->match = req->match;
+    txn->maxResponses = req->maxResponses;
+    txn->responses = 0;
+    txn->expiryTick = canTxnTick(nowUs) + ((ticks > 0) ? ticks : 1);
+
+    /* the expiry may be behind the last tick seen if the clock lagged */
+    if (txn->expiryTick <= t->tick) {
+        txn->expiryTick = t->tick + 1;
+    }
+    canTxnLink(t, i);
+    canTxnIdLink(t, i);
+
+    /* with others in flight, an unknown next tick stays unknown */
+    if ((t->active == 0) ||
+        ((t->nextTick != 0) && (txn->expiryTick < t->nextTick))) {
+        t->nextTick = txn->expiryTick;
+    }
+
+    if (++t->active > t->highWater) {
+        t->highWater = t->active;
+    }
+    t->started++;
+}
+
+/* hands a response to a transaction, ending it after the last one */
+static int canTxnRespond(canTxnTable_t *t, int i, const struct can_frame *frame,
+    canTxnEvent_t *events)
+{
+    canTxn_t *txn = &t->txns[i];
+    int count = 0;
+
+    events[count].client = txn->client;
+    events[count].tag = txn->tag;
+    events[count].kind = CAN_TXN_RESPONSE;
+    events[count].frame = *frame;
+    count++;
+    t->responses++;
+
+    if (++txn->responses == txn->maxResponses) {
+        events[count].client = txn->client;
+        events[count].tag = txn->tag;
+        events[count].kind = CAN_TXN_DONE;
+        count++;
+        t->completed++;
+        canTxnEnd(t, i);
+    }
+    return count;
+}
+
+/**
+ * Hands a received frame to the transactions waiting for it.
+ *
+ * @param t the transaction table
+ * @param frame a data frame received on the clients' bus
+ * @param events array of at least 2 * CAN_TXN_MAX entries for the
+ *        responses and the transactions this completes
+ *
+ * @return int the number of entries filled in to events
+ */
+int canTxnMatch(canTxnTable_t *t, const struct can_frame *frame,
+    canTxnEvent_t *events)
+{
+    /* an exact ID answers for the frame's ID bits and its RTR flag */
+    const canid_t id = frame->can_id &
+                       (CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG);
+    const canDispatchSlot_t *slot;
+    int count = 0;
+    int i;
+
+    if (t->active == 0) {
+        return 0;
+    }
+
+    slot = canTxnIndexFind(t, id);
+    i = (slot->id != CAN_DISPATCH_EMPTY) ? slot->chain : CAN_TXN_NONE;
+    while (i != CAN_TXN_NONE) {
+        const int next = t->txns[i].idNext;
+        count += canTxnRespond(t, i, frame, events + count);
+        i = next;
+    }
+
+    for (i = t->masked; i != CAN_TXN_NONE; ) {
+        const canTxn_t *txn = &t->txns[i];
+        const int next = txn->idNext;
+
+        if ((frame->can_id & (txn->match.mask | CAN_EFF_FLAG | CAN_RTR_FLAG)) ==
+            txn->match.id) {
+            count += canTxnRespond(t, i, frame, events + count);
+        }
+        i = next;
+    }
+
+    return count;
+}
+
+/**
+ * Ends the transactions whose timeout has run out.
+ *
+ * @param t the transaction table
+ * @param nowUs the current canNowUs() time
+ * @param events array of at least CAN_TXN_MAX entries for the timeouts
+ *
+ * @return int the number of entries filled in to events
+ */
+int canTxnExpire(canTxnTable_t *t, uint64_t nowUs, canTxnEvent_t *events)
+{
+    const uint64_t nowTick = canTxnTick(nowUs);
+    int count = 0;
+    int slots;
+
+    if (nowTick <= t->tick) {
+        return 0;
+    }
+
+    /* after a whole turn every slot has been looked at */
+    slots = (nowTick - t->tick >= CAN_TXN_WHEEL_SLOTS) ?
+            CAN_TXN_WHEEL_SLOTS : (int)(nowTick - t->tick);
+
+    while ((slots-- > 0) && (t->active > 0)) {
+        const uint64_t tick = ++t->tick;
+        int i = t->wheel[tick % CAN_TXN_WHEEL_SLOTS];
+
+        while (i != CAN_TXN_NONE) {
+            canTxn_t *txn = &t->txns[i];
+            const int next = txn->next;
+
+            if (txn->expiryTick <= nowTick) {
+                events[count].client = txn->client;
+                events[count].tag = txn->tag;
+                events[count].kind = CAN_TXN_TIMEOUT;
+                count++;
+                t->timedOut++;
+                canTxnEnd(t, i);
+            }
+            i = next;
+        }
+    }
+    t->tick = nowTick;
+    if (t->nextTick <= nowTick) {
+        t->nextTick = 0;
+    }
+
+    return count;
+}
+
+/**
+ * Returns when canTxnExpire() next has work to do, 0 if no transaction
+ * is in flight.
+ */
+uint64_t canTxnNextUs(canTxnTable_t *t)
+{
+    uint64_t tick;
+
+    if (t->active == 0) {
+        return 0;
+    }
+    if (t->nextTick != 0) {
+        return t->nextTick * CAN_TXN_TICK_US;
+    }
+
+    for (tick = t->tick + 1; tick <= t->tick + CAN_TXN_WHEEL_SLOTS; tick++) {
+        int i;
+
+        for (i = t->wheel[tick % CAN_TXN_WHEEL_SLOTS]; i != CAN_TXN_NONE;
+             i = t->txns[i].next) {
+            if (t->txns[i].expiryTick == tick) {
+                t->nextTick = tick;
+                return tick * CAN_TXN_TICK_US;
+            }
+        }
+    }
+
+    /* everything is more than a turn away, come back after one */
+    t->nextTick = tick;
+    return tick * CAN_TXN_TICK_US;
+}
+
+/**
+ * Drops the transactions of a client that disconnected.
+ */
+void canTxnReleaseClient(canTxnTable_t *t, int client)
+{
+    int i;
+
+    for (i = 0; (i < CAN_TXN_MAX) && (t->active > 0); i++) {
+        if (t->txns[i].client == client) {
+            t->cancelled++;
+            canTxnEnd(t, i);
+        }
+    }
+}
+
+/**
+ * Formats the line that tells a client about a transaction.
+ *
+ * @param event what happened
+ * @param out buffer of at least CAN_TEXT_MAX_LINE + 16 bytes
+ *
+ * @return int the number of characters written; out is NUL ended
+ */
+int canTxnFormatEvent(const canTxnEvent_t *event, char *out)
+{
+    int len = sprintf(out, "=%u ", event->tag);
+
+    switch (event->kind) {
+    case CAN_TXN_RESPONSE:
+        len += canTextFormat((const struct canfd_frame *)&event->frame,
+                             CAN_MTU, out + len);
+        out[len] = '\0';
+        break;
+    case CAN_TXN_DONE:
+        len += sprintf(out + len, "done\n");
+        break;
+    case CAN_TXN_TIMEOUT:
+        len += sprintf(out + len, "timeout\n");
+        break;
+    default:
+        len += sprintf(out + len, "error\n");
+        break;
+    }
+    return len;
+}
+
+/**
+ * Logs the transaction counters.
+ */
+void canTxnLogStats(const canTxnTable_t *t)
+{
+    LogMsg(LOG_NOTICE, "transactions: %d in flight (high water %d of %d), "
+        "started %llu, completed %llu, timed out %llu, cancelled %llu, "
+        "responses %llu\n",
+        t->active, t->highWater, CAN_TXN_MAX, (unsigned long long)t->started,
+        (unsigned long long)t->completed, (unsigned long long)t->timedOut,
+        (unsigned long long)t->cancelled, (unsigned long long)t->responses);
+}
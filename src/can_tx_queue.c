@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+
+#include "can_agent.h"
+
+/*
+ * Frames waiting for the CAN bus are kept in a binary min-heap keyed on
+ * the frame's arbitration priority so the agent hands the controller
+ * the frame that would win arbitration first.  Frames with the same
+ * priority leave in the order they were queued.
+ */
+
+/**
+ * Builds a sort key from a CAN ID that orders frames the way bus
+ * arbitration does: the 11 base ID bits first, then RTR (standard) or
+ * SRR (extended), then IDE, then the 18 extended ID bits and the
+ * extended RTR bit.  A lower key wins.
+ */
+static uint32_t canTxPriority(canid_t id)
+{
+    const uint32_t rtr = (id & CAN_RTR_FLAG) ? 1 : 0;
+
+    if (id & CAN_EFF_FLAG) {
+        const uint32_t eff = id & CAN_EFF_MASK;
+        return ((eff >> 18) << 20) | (1 << 19) | (1 << 18) |
+               ((eff & 0x3FFFF) << 1) | rtr;
+    }
+
+    return ((id & CAN_SFF_MASK) << 20) | (rtr << 19);
+}
+
+static int canTxBefore(const canTxEntry_t *a, const canTxEntry_t *b)
+{
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+static void canTxSiftUp(canTxQueue_t *q, int i)
+{
+    canTxEntry_t entry = q->heap[i];
+
+    while (i > 0) {
+        const int parent = (i - 1) / 2;
+        if (!canTxBefore(&entry, &q->heap[parent])) {
+            break;
+        }
+        q->heap[i] = q->heap[parent];
+        i = parent;
+    }
+    q->heap[i] = entry;
+}
+
+static void canTxSiftDown(canTxQueue_t *q, int i)
+{
+    canTxEntry_t entry = q->heap[i];
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= q->count) {
+            break;
+        }
+        if ((child + 1 < q->count) &&
+            canTxBefore(&q->heap[child + 1], &q->heap[child])) {
+            child++;
+        }
+        if (!canTxBefore(&q->heap[child], &entry)) {
+            break;
+        }
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = entry;
+}
+
+static void canTxInsert(canTxQueue_t *q, const canTxEntry_t *entry)
+{
+    q->heap[q->count] = *entry;
+    canTxSiftUp(q, q->count++);
+}
+
+static void canTxRemoveTop(canTxQueue_t *q, canTxEntry_t *entry)
+{
+    *entry = q->heap[0];
+    if (--q->count > 0) {
+        q->heap[0] = q->heap[q->count];
+        canTxSiftDown(q, 0);
+    }
+}
+
+/**
+ * Prepares an empty transmit queue.
+ *
+ * @param q the queue to initialise
+ * @param clientQuota the most frames a single client may have queued
+ *        at once, 0 for no limit
+ */
+void canTxQueueInit(canTxQueue_t *q, int clientQuota)
+{
+    memset(q, 0, sizeof(*q));
+    q->clientQuota = clientQuota;
+}
+
+/**
+ * Queues a frame for transmission.
+ *
+ * @param q the transmit queue
+ * @param frame the frame to send
+ * @param client the client slot the frame came from, or -1
+ * @param originUs when the gateway received the frame on another bus,
+ *        0 for frames from clients
+ *
+ * @return int 0 on success, -1 if the queue is full or the client has
+ *         used up its quota (the frame is dropped)
+ */
+int canTxQueuePush(canTxQueue_t *q, const struct can_frame *frame,
+    int client, uint64_t originUs)
+{
+    canTxEntry_t entry;
+
+    if (q->count == CAN_TX_QUEUE_DEPTH) {
+        q->stats.rejectedFull++;
+        return -1;
+    }
+    if ((client >= 0) && (q->clientQuota > 0) &&
+        (q->clientCount[client] >= q->clientQuota)) {
+        q->stats.rejectedQuota++;
+        return -1;
+    }
+
+    entry.frame = *frame;
+    entry.key = canTxPriority(frame->can_id);
+    entry.seq = q->seq++;
+    entry.client = client;
+    entry.enqueueUs = canNowUs();
+    entry.originUs = originUs;
+    canTxInsert(q, &entry);
+
+    if (client >= 0) {
+        q->clientCount[client]++;
+    }
+    if (q->count > q->stats.depthHighWater) {
+        q->stats.depthHighWater = q->count;
+    }
+
+    return 0;
+}
+
+/**
+ * Remembers a frame handed to the controller so its loopback copy can
+ * be matched up by canTxQueueConfirm().
+ */
+static void canTxTrackSent(canTxQueue_t *q, const struct can_frame *frame,
+    uint64_t nowUs)
+{
+    int slot;
+
+    if (q->inflightCount == CAN_TX_QUEUE_DEPTH) {
+        /* oldest frame never came back, forget it */
+        q->inflightHead = (q->inflightHead + 1) % CAN_TX_QUEUE_DEPTH;
+        q->inflightCount--;
+        q->stats.unconfirmed++;
+    }
+
+    slot = (q->inflightHead + q->inflightCount) % CAN_TX_QUEUE_DEPTH;
+    q->inflight[slot].frame = *frame;
+    q->inflight[slot].sentUs = nowUs;
+    q->inflightCount++;
+}
+
+/**
+ * Writes queued frames to the CAN bus in priority order until the
+ * queue is empty or the controller pushes back with ENOBUFS/EAGAIN.
+ * Frames that could not be written stay queued for the next call, also
+ * while the interface is down for a restart (ENETDOWN).
+ *
+ * @param q the transmit queue
+ * @param socketFd the CAN raw socket, opened non-blocking
+ *
+ * @return int the number of frames still queued, or -1 if ENOBUFS or
+ *         ENETDOWN was returned (the caller should back off before
+ *         retrying)
+ */
+int canTxQueueFlush(canTxQueue_t *q, int socketFd)
+{
+    canTxEntry_t batch[CAN_TX_BATCH_SIZE];
+    struct can_frame frames[CAN_TX_BATCH_SIZE];
+
+    while (q->count > 0) {
+        int count = 0;
+        int sent;
+        int i;
+        uint64_t nowUs;
+
+        while ((count < CAN_TX_BATCH_SIZE) && (q->count > 0)) {
+            canTxRemoveTop(q, &batch[count]);
+            frames[count] = batch[count].frame;
+            count++;
+        }
+
+        sent = canServerSocketWriteBatch(socketFd, frames, count);
+        if (sent < 0) {
+            const int err = errno;
+
+            if ((err != ENOBUFS) && (err != ENETDOWN) &&
+                (err != EAGAIN) && (err != EWOULDBLOCK)) {
+                /* this will not go away by retrying, drop the batch */
+                LogMsg(LOG_ERR, "%s(): dropping %d frames: %s\n",
+                    __FUNCTION__, count, strerror(err));
+                for (i = 0; i < count; i++) {
+                    if (batch[i].client >= 0) {
+                        q->clientCount[batch[i].client]--;
+                    }
+                }
+                q->stats.dropped += count;
+                continue;
+            }
+
+            /* put the whole batch back, order is kept */
+            for (i = 0; i < count; i++) {
+                canTxInsert(q, &batch[i]);
+            }
+            q->stats.retries++;
+            return ((err == ENOBUFS) || (err == ENETDOWN)) ? -1 : q->count;
+        }
+
+        nowUs = canNowUs();
+        for (i = 0; i < sent; i++) {
+            const uint64_t waitUs = nowUs - batch[i].enqueueUs;
+
+            if (batch[i].client >= 0) {
+                q->clientCount[batch[i].client]--;
+            }
+            q->stats.sent++;
+            q->stats.waitTotalUs += waitUs;
+            if (waitUs > q->stats.waitMaxUs) {
+                q->stats.waitMaxUs = waitUs;
+            }
+            canTxTrackSent(q, &batch[i].frame, nowUs);
+
+            if (batch[i].originUs != 0) {
+                const uint64_t fwdUs = nowUs - batch[i].originUs;
+                q->stats.forwarded++;
+                q->stats.fwdTotalUs += fwdUs;
+                if (fwdUs > q->stats.fwdMaxUs) {
+                    q->stats.fwdMaxUs = fwdUs;
+                }
+            }
+        }
+
+        /* the controller took part of the batch, retry the rest later */
+        for (i = sent; i < count; i++) {
+            canTxInsert(q, &batch[i]);
+        }
+        if (sent < count) {
+            q->stats.retries++;
+            break;
+        }
+    }
+
+    return q->count;
+}
+
+/**
+ * Forgets a client slot's quota usage when it disconnects; its queued
+ * frames are still sent.
+ */
+void canTxQueueReleaseClient(canTxQueue_t *q, int client)
+{
+    int i;
+
+    for (i = 0; i < q->count; i++) {
+        if (q->heap[i].client == client) {
+            q->heap[i].client = -1;
+        }
+    }
+    q->clientCount[client] = 0;
+}
+
+/**
+ * Matches the loopback copy of a frame this agent sent (received with
+ * MSG_CONFIRM) against the frames in flight, which marks it as
+ * transmitted on the bus.
+ *
+ * @param q the transmit queue
+ * @param frame the looped back frame
+ */
+void canTxQueueConfirm(canTxQueue_t *q, const struct can_frame *frame)
+{
+    int i;
+
+    for (i = 0; i < q->inflightCount; i++) {
+        const int slot = (q->inflightHead + i) % CAN_TX_QUEUE_DEPTH;
+        const struct can_frame *sent = &q->inflight[slot].frame;
+
+        if ((sent->can_id == frame->can_id) &&
+            (sent->can_dlc == frame->can_dlc) &&
+            (memcmp(sent->data, frame->data, frame->can_dlc) == 0)) {
+            const uint64_t latencyUs = canNowUs() - q->inflight[slot].sentUs;
+
+            /* frames ahead of this one were lost by the driver */
+            q->stats.unconfirmed += i;
+            q->stats.confirmed++;
+            q->stats.completeTotalUs += latencyUs;
+            if (latencyUs > q->stats.completeMaxUs) {
+                q->stats.completeMaxUs = latencyUs;
+            }
+
+            q->inflightHead = (slot + 1) % CAN_TX_QUEUE_DEPTH;
+            q->inflightCount -= i + 1;
+            return;
+        }
+    }
+}
+
+/**
+ * Logs the transmit queue metrics.
+ */
+void canTxQueueLogStats(const canTxQueue_t *q, const char *name)
+{
+    const canTxStats_t *s = &q->stats;
+
+    LogMsg(LOG_NOTICE, "%s tx: depth %d (max %d), in flight %d, "
+        "sent %llu, confirmed %llu, unconfirmed %llu\n",
+        name, q->count, s->depthHighWater, q->inflightCount,
+        (unsigned long long)s->sent, (unsigned long long)s->confirmed,
+        (unsigned long long)s->unconfirmed);
+    LogMsg(LOG_NOTICE, "%s tx: wait avg %llu us (max %llu), "
+        "complete avg %llu us (max %llu)\n",
+        name,
+        (unsigned long long)(s->sent ? s->waitTotalUs / s->sent : 0),
+        (unsigned long long)s->waitMaxUs,
+        (unsigned long long)(s->confirmed ?
+                             s->completeTotalUs / s->confirmed : 0),
+        (unsigned long long)s->completeMaxUs);
+    LogMsg(LOG_NOTICE, "%s tx: rejected full %llu, rejected quota %llu, "
+        "retries %llu, dropped %llu\n",
+        name, (unsigned long long)s->rejectedFull,
+        (unsigned long long)s->rejectedQuota,
+        (unsigned long long)s->retries, (unsigned long long)s->dropped);
+    if (s->forwarded > 0) {
+        LogMsg(LOG_NOTICE, "%s tx: forwarded %llu, latency avg %llu us "
+            "(max %llu)\n",
+            name, (unsigned long long)s->forwarded,
+            (unsigned long long)(s->fwdTotalUs / s->forwarded),
+            (unsigned long long)s->fwdMaxUs);
+    }
+}
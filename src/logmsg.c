@@ -48,6 +48,27 @@ void LogOpen(const char *ident, int logToSyslog, const char *logFilePath,
     verboseOn = verboseFlag;
 }
 
+/**
+ * Turns the informational and debug messages on or off without
+ * reopening the log.
+ */
+void LogSetVerbose(int verboseFlag)
+{
+    verboseOn = verboseFlag;
+}
+
+/**
+ * Closes a log file opened by LogOpen().  Messages logged afterwards go
+ * to the standard error stream.
+ */
+void LogClose(void)
+{
+    if ((logFile != 0) && (logFile != stderr)) {
+        fclose(logFile);
+    }
+    logFile = stderr;
+}
+
 void LogMsg(int level, const char *fmt, ...)
 {
     /* 